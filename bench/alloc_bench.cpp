@@ -0,0 +1,149 @@
+// bench/alloc_bench.cpp
+// Heap allocations per chat line in steady state, from postMessage()
+// through broadcastMessage() to the writer threads' sends, for rooms of a
+// few sizes. Members are thread-engine connections on socketpairs whose far
+// ends are drained by the benchmark.
+//
+//   alloc_bench [messages per room]
+#define CHAT_SERVER_NO_MAIN
+// GCC pairs the inlined operator delete below with new-expressions and
+// warns about free(); both sides are this file's malloc and free
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+#include "main_server.cpp"
+
+#include <new>
+
+#define DEFAULT_MESSAGES 100000   // measured posts per room
+#define WARMUP (2 * MAX_MESSAGE_HISTORY)  // fills history, pools and queues first
+#define BURST 64                  // posts between waits for the room to drain
+
+// ==========================
+// Allocation Counting
+// ==========================
+
+atomic<uint64_t> allocations{0};
+thread_local uint64_t threadAllocations = 0;
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    threadAllocations++;
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+// ==========================
+// Room Setup
+// ==========================
+
+// One member: the server side runs connectionWriter, the peer side is read
+// and discarded
+struct Member {
+    shared_ptr<Connection> conn;
+    thread writer;
+    thread drain;
+    SOCKET peer;
+};
+
+void drainPeer(SOCKET peer) {
+    char buffer[65536];
+    while (read(peer, buffer, sizeof(buffer)) > 0) {}
+}
+
+vector<unique_ptr<Member>> joinRoom(const string& room, int size) {
+    vector<unique_ptr<Member>> members;
+    for (int i = 0; i < size; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            perror("socketpair");
+            exit(1);
+        }
+        auto member = make_unique<Member>();
+        member->conn = make_shared<Connection>();
+        member->conn->session.sock = sv[0];
+        member->conn->session.username = room + "-user" + to_string(i);
+        member->conn->session.currentRoom = room;
+        member->conn->greeted = true;
+        member->peer = sv[1];
+        registerConnection(member->conn);
+        member->writer = thread(connectionWriter, member->conn);
+        member->drain = thread(drainPeer, member->peer);
+        onClientConnected(member->conn->session);
+        members.push_back(move(member));
+    }
+    return members;
+}
+
+void leaveRoom(vector<unique_ptr<Member>>& members) {
+    for (auto& member : members) {
+        onClientDisconnected(member->conn->session);
+        shutdown(member->conn->session.sock, SD_BOTH);
+        {
+            lock_guard<mutex> lock(member->conn->outMtx);
+            member->conn->closed = true;
+            member->conn->outCv.notify_all();
+        }
+        member->writer.join();
+        closeConnection(member->conn);
+        member->drain.join();
+        closesocket(member->peer);
+    }
+    members.clear();
+}
+
+// Every posted line broadcast and every member's queue written out
+void waitIdle(const vector<unique_ptr<Member>>& members) {
+    while (true) {
+        bool idle = metrics.broadcastsDelivered.value() == metrics.broadcastsQueued.value();
+        for (const auto& member : members) {
+            lock_guard<mutex> lock(member->conn->outMtx);
+            idle = idle && member->conn->outq.empty() && member->conn->writing == 0;
+        }
+        if (idle) return;
+        this_thread::sleep_for(chrono::microseconds(200));
+    }
+}
+
+void post(ClientSession& sender, const vector<string>& lines, int count, const vector<unique_ptr<Member>>& members) {
+    for (int i = 0; i < count; i++) {
+        postMessage(sender, lines[i % lines.size()]);
+        if ((i + 1) % BURST == 0) waitIdle(members);
+    }
+    waitIdle(members);
+}
+
+int main(int argc, char* argv[]) {
+    int messages = argc > 1 ? atoi(argv[1]) : DEFAULT_MESSAGES;
+    vector<string> lines = {
+        "hello everyone, how is it going today?",
+        "the build is green again after the last fix",
+        "anyone up for lunch at noon",
+        "see the notes from yesterday's meeting for details",
+    };
+    broadcastPool.start(1);
+
+    printf("%d messages per room after %d warm-up posts\n", messages, WARMUP);
+    printf("%-8s %14s %14s %14s\n", "members", "post thread", "other threads", "total");
+    for (int size : {1, 8, 64}) {
+        string room = "room" + to_string(size);
+        vector<unique_ptr<Member>> members = joinRoom(room, size);
+        ClientSession& sender = members[0]->conn->session;
+
+        post(sender, lines, WARMUP, members);
+        uint64_t total = allocations.load();
+        uint64_t own = threadAllocations;
+        post(sender, lines, messages, members);
+        double totalPer = double(allocations.load() - total) / messages;
+        double ownPer = double(threadAllocations - own) / messages;
+        printf("%-8d %14.2f %14.2f %14.2f\n", size, ownPer, totalPer - ownPer, totalPer);
+        fflush(stdout);
+
+        leaveRoom(members);
+    }
+    broadcastPool.shutdown();
+    return 0;
+}
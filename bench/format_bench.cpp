@@ -0,0 +1,71 @@
+// bench/format_bench.cpp
+// Formatting a chat line "[HH:MM:SS][sender]: text": the version that ran
+// localtime and strftime and concatenated temporaries on every call, next
+// to the cached Clock with toString() and with appendTo() into a reused
+// buffer.
+//
+//   format_bench [iterations]
+#define CHAT_SERVER_NO_MAIN
+#include "main_server.cpp"
+
+#define DEFAULT_ITERATIONS 5000000
+#define RUNS 3                    // the best run of each variant is reported
+
+// ==========================
+// Formatting Before the Clock Cache
+// ==========================
+
+string uncachedTimeString() {
+    time_t now = time(nullptr);
+    tm local;
+    localTime(now, local);
+
+    char buffer[20];
+    strftime(buffer, sizeof(buffer), "%H:%M:%S", &local);
+    return string(buffer);
+}
+
+string uncachedFormat(const string& sender, const string& message) {
+    return "[" + uncachedTimeString() + "][" + sender + "]: " + message;
+}
+
+// ==========================
+// Benchmarks
+// ==========================
+
+// Best ns per call of f over RUNS runs; f returns a byte count so the
+// compiler cannot drop the work
+template <typename F>
+double nanosPer(size_t iterations, F f) {
+    double best = 1e18;
+    size_t bytes = 0;
+    for (int run = 0; run < RUNS; run++) {
+        auto begin = chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++) bytes += f();
+        best = min(best, chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count() / iterations);
+    }
+    if (bytes == 0) cerr << "format_bench: nothing formatted" << endl;
+    return best;
+}
+
+int main(int argc, char* argv[]) {
+    size_t iterations = argc > 1 ? (size_t)atoll(argv[1]) : DEFAULT_ITERATIONS;
+    MessageRef msg = MessageRef::create(1, nameTable.intern("alice"), "the build is green again after the fix",
+                                        nameTable.intern("general"));
+    string reused;
+
+    double before = nanosPer(iterations, [&] { return uncachedFormat(msg->sender, msg->text).size(); });
+    double toString = nanosPer(iterations, [&] { return msg->toString().size(); });
+    double appendTo = nanosPer(iterations, [&] {
+        reused.clear();
+        msg->appendTo(reused);
+        return reused.size();
+    });
+
+    printf("%zu iterations, best of %d, %zu-byte line\n", iterations, RUNS, msg->toString().size());
+    printf("%-28s %9s %9s\n", "variant", "ns/op", "speedup");
+    printf("%-28s %9.1f %8.1fx\n", "uncached, concatenated", before, 1.0);
+    printf("%-28s %9.1f %8.1fx\n", "cached, toString()", toString, before / toString);
+    printf("%-28s %9.1f %8.1fx\n", "cached, appendTo(reused)", appendTo, before / appendTo);
+    return 0;
+}
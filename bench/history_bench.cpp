@@ -0,0 +1,197 @@
+// bench/history_bench.cpp
+// Cost of the History operations on the post, /undo and /history paths,
+// for the ring buffer and for the doubly linked list it replaced, at 1k and
+// 100k messages of capacity.
+//
+//   history_bench
+#define CHAT_SERVER_NO_MAIN
+#include "main_server.cpp"
+
+#include <numeric>
+#include <random>
+
+#define ADDS 1000000              // messages posted into a full history
+#define REMOVES 1000              // undos per removal pattern
+#define READ_MESSAGES 10000000    // messages copied out by getMessages() calls
+
+// ==========================
+// Linked List History
+// ==========================
+
+// The history before the ring buffer: a node allocated per message, holding
+// its own copy, and a walk from the oldest node to find an id
+class ListHistory {
+public:
+    struct Entry {
+        int id;
+        string sender;
+        string text;
+        string room;
+        time_t timestamp;
+    };
+
+private:
+    struct Node {
+        Entry message;
+        Node* next;
+        Node* prev;
+
+        Node(const Entry& msg) : message(msg), next(nullptr), prev(nullptr) {}
+    };
+
+    Node* head;
+    Node* tail;
+    int size;
+    int maxSize;
+    mutable mutex mtx;
+
+public:
+    ListHistory(int maxSize) : head(nullptr), tail(nullptr), size(0), maxSize(maxSize) {}
+
+    ~ListHistory() {
+        while (head) {
+            Node* next = head->next;
+            delete head;
+            head = next;
+        }
+    }
+
+    void addMessage(const Entry& msg) {
+        lock_guard<mutex> lock(mtx);
+        Node* newNode = new Node(msg);
+        if (head == nullptr) {
+            head = tail = newNode;
+        } else {
+            tail->next = newNode;
+            newNode->prev = tail;
+            tail = newNode;
+        }
+        size++;
+        if (size > maxSize) {
+            Node* temp = head;
+            head = head->next;
+            if (head) head->prev = nullptr;
+            delete temp;
+            size--;
+        }
+    }
+
+    void removeMessage(int messageId) {
+        lock_guard<mutex> lock(mtx);
+        for (Node* current = head; current != nullptr; current = current->next) {
+            if (current->message.id == messageId) {
+                if (current->prev) current->prev->next = current->next;
+                if (current->next) current->next->prev = current->prev;
+                if (current == head) head = current->next;
+                if (current == tail) tail = current->prev;
+                delete current;
+                size--;
+                return;
+            }
+        }
+    }
+
+    list<Entry> getMessages() const {
+        lock_guard<mutex> lock(mtx);
+        list<Entry> result;
+        for (Node* current = head; current != nullptr; current = current->next) {
+            result.push_back(current->message);
+        }
+        return result;
+    }
+};
+
+// ==========================
+// Benchmarks
+// ==========================
+
+Name benchSender = nameTable.intern("alice");
+Name benchRoom = nameTable.intern("general");
+
+string benchText(int id) {
+    return "message " + to_string(id) + " from the history benchmark";
+}
+
+// Both histories behind one interface; add() builds the message the way the
+// post path of each version did
+struct ListBench {
+    ListHistory history;
+    ListBench(int capacity) : history(capacity) {}
+    void add(int id) { history.addMessage({id, benchSender, benchText(id), benchRoom, time(nullptr)}); }
+    void remove(int id) { history.removeMessage(id); }
+    size_t read() { return history.getMessages().size(); }
+};
+
+struct RingBench {
+    History history;
+    RingBench(int capacity) : history(capacity) {}
+    void add(int id) { history.addMessage(MessageRef::create(id, benchSender, benchText(id), benchRoom)); }
+    void remove(int id) { history.removeMessage(id); }
+    size_t read() { return history.getMessages().size(); }
+};
+
+template <typename F>
+double nanosPer(size_t ops, F f) {
+    auto begin = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count() / ops;
+}
+
+// ns per operation for: post into a full history, undo the newest message,
+// undo a random one, and copy the whole history out
+template <typename Bench>
+vector<double> measure(int capacity) {
+    vector<double> results;
+    mt19937 rng(1);
+
+    {
+        Bench bench(capacity);
+        for (int id = 1; id <= capacity; id++) bench.add(id);
+        results.push_back(nanosPer(ADDS, [&] {
+            for (int id = capacity + 1; id <= capacity + ADDS; id++) bench.add(id);
+        }));
+    }
+    {
+        Bench bench(capacity);
+        for (int id = 1; id <= capacity; id++) bench.add(id);
+        results.push_back(nanosPer(REMOVES, [&] {
+            for (int id = capacity; id > capacity - REMOVES; id--) bench.remove(id);
+        }));
+    }
+    {
+        Bench bench(capacity);
+        for (int id = 1; id <= capacity; id++) bench.add(id);
+        vector<int> ids(capacity);
+        iota(ids.begin(), ids.end(), 1);
+        shuffle(ids.begin(), ids.end(), rng);
+        results.push_back(nanosPer(REMOVES, [&] {
+            for (int i = 0; i < REMOVES; i++) bench.remove(ids[i]);
+        }));
+    }
+    {
+        Bench bench(capacity);
+        for (int id = 1; id <= capacity; id++) bench.add(id);
+        size_t reads = READ_MESSAGES / capacity;
+        size_t copied = 0;
+        results.push_back(nanosPer(reads, [&] {
+            for (size_t i = 0; i < reads; i++) copied += bench.read();
+        }));
+        if (copied != reads * capacity) cerr << "history_bench: getMessages() returned " << copied << endl;
+    }
+    return results;
+}
+
+int main() {
+    const char* operations[] = {"add (full)", "undo newest", "undo random", "getMessages"};
+
+    printf("%-9s %-13s %13s %13s %9s\n", "capacity", "operation", "list ns/op", "ring ns/op", "speedup");
+    for (int capacity : {1000, 100000}) {
+        vector<double> list = measure<ListBench>(capacity);
+        vector<double> ring = measure<RingBench>(capacity);
+        for (size_t i = 0; i < list.size(); i++) {
+            printf("%-9d %-13s %13.1f %13.1f %8.1fx\n", capacity, operations[i], list[i], ring[i], list[i] / ring[i]);
+        }
+        fflush(stdout);
+    }
+    return 0;
+}
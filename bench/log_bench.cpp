@@ -0,0 +1,128 @@
+// bench/log_bench.cpp
+// The --data-dir message log with one big room: append throughput with
+// group commit, the cold-start reload that memory-maps the newest segment,
+// and readBefore() pages at several depths. Runs in a fresh directory under
+// TMPDIR (or /tmp) and removes it afterwards.
+//
+//   log_bench [messages]
+#define CHAT_SERVER_NO_MAIN
+#include "main_server.cpp"
+
+#define DEFAULT_MESSAGES 10000000
+#define PAGE 50                   // messages per readBefore(), as /history pages
+#define PAGE_READS 1000           // readBefore() calls per depth
+
+void removeTree(const string& path) {
+    if (DIR* d = opendir(path.c_str())) {
+        while (dirent* entry = readdir(d)) {
+            string name = entry->d_name;
+            if (name == "." || name == "..") continue;
+            string child = path + "/" + name;
+            struct stat st;
+            if (lstat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) removeTree(child);
+            else unlink(child.c_str());
+        }
+        closedir(d);
+    }
+    rmdir(path.c_str());
+}
+
+// Bytes and segment files under dir, one level of room directories deep
+void diskUsage(const string& dir, uint64_t& bytes, int& segments) {
+    bytes = 0;
+    segments = 0;
+    DIR* d = opendir(dir.c_str());
+    if (!d) return;
+    while (dirent* entry = readdir(d)) {
+        string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        string roomDir = dir + "/" + name;
+        if (DIR* r = opendir(roomDir.c_str())) {
+            while (dirent* file = readdir(r)) {
+                struct stat st;
+                if (stat((roomDir + "/" + file->d_name).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+                bytes += (uint64_t)st.st_size;
+                if (strstr(file->d_name, ".seg")) segments++;
+            }
+            closedir(r);
+        }
+    }
+    closedir(d);
+}
+
+double secondsSince(chrono::steady_clock::time_point begin) {
+    return chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+}
+
+int main(int argc, char* argv[]) {
+    int messages = argc > 1 ? atoi(argv[1]) : DEFAULT_MESSAGES;
+    const char* tmp = getenv("TMPDIR");
+    string pattern = string(tmp && *tmp ? tmp : "/tmp") + "/log_bench.XXXXXX";
+    if (!mkdtemp(&pattern[0])) {
+        perror("log_bench: mkdtemp");
+        return 1;
+    }
+    string dataDir = pattern;
+    Name sender = nameTable.intern("alice");
+    Name room = nameTable.intern("general");
+    const string text = "the build is green again after the last fix";
+
+    // Appends return once the record is buffered; close() waits for the
+    // writer's last group commit
+    {
+        RoomHistories histories;
+        MessageLog log;
+        if (log.open(dataDir, histories) < 0) {
+            perror("log_bench: open");
+            return 1;
+        }
+        RoomLog* roomLog = log.roomLog(room);
+        if (!roomLog) return 1;
+
+        auto begin = chrono::steady_clock::now();
+        for (int id = 0; id < messages; id++) {
+            MessageRef msg = MessageRef::create(id, sender, text, room);
+            log.append(roomLog, *msg);
+        }
+        double appended = secondsSince(begin);
+        log.close();
+        double durable = secondsSince(begin);
+
+        uint64_t bytes;
+        int segments;
+        diskUsage(dataDir, bytes, segments);
+        printf("%d messages, %.0f MiB in %d segments\n", messages, bytes / 1048576.0, segments);
+        printf("%-24s %10.2f M/s %10.1f ns/message\n", "append", messages / appended / 1e6, appended * 1e9 / messages);
+        printf("%-24s %10.2f M/s %10.1f ns/message\n", "append until durable", messages / durable / 1e6,
+               durable * 1e9 / messages);
+    }
+
+    // Cold start: replay fills the room's in-memory window from the newest
+    // segment and restores the next id
+    {
+        RoomHistories histories;
+        MessageLog log;
+        auto begin = chrono::steady_clock::now();
+        int nextId = log.open(dataDir, histories);
+        double reload = secondsSince(begin);
+        size_t restored = histories.room(room).getMessages().size();
+        printf("%-24s %10.2f ms, %zu messages restored, next id %d\n", "reload", reload * 1e3, restored, nextId);
+        if (nextId != messages) cerr << "log_bench: expected next id " << messages << endl;
+
+        // Pages just past the window, halfway back and at the very start
+        printf("%-24s %10s %14s\n", "readBefore(50)", "before id", "us/page");
+        for (int beforeId : {messages - MAX_MESSAGE_HISTORY, messages / 2, PAGE}) {
+            if (beforeId <= 0) continue;
+            size_t read = 0;
+            begin = chrono::steady_clock::now();
+            for (int i = 0; i < PAGE_READS; i++) read += log.readBefore(room, beforeId, PAGE).size();
+            double micros = secondsSince(begin) * 1e6 / PAGE_READS;
+            printf("%-24s %10d %14.1f\n", "", beforeId, micros);
+            if (read == 0) cerr << "log_bench: readBefore(" << beforeId << ") returned nothing" << endl;
+        }
+        log.close();
+    }
+
+    removeTree(dataDir);
+    return 0;
+}
@@ -0,0 +1,95 @@
+// bench/queue_bench.cpp
+// Throughput of the broadcast queue: P producer threads push events while
+// one consumer drains them, for the lock-free MessageQueue and for the
+// mutex + condition variable queue it replaced.
+//
+//   queue_bench [events per run]
+#define CHAT_SERVER_NO_MAIN
+#include "main_server.cpp"
+
+#include <future>
+
+#define DEFAULT_EVENTS 2000000    // events pushed per run, all producers together
+#define RUNS 3                    // the best run of each configuration is reported
+
+// The queue MessageQueue replaced: one mutex around a std::queue, and a
+// notify on every push. It counts the same metrics so both do equal work.
+class MutexQueue {
+private:
+    queue<BroadcastEvent> events;
+    mutex mtx;
+    condition_variable cv;
+
+public:
+    void push(BroadcastEvent event) {
+        metrics.broadcastsQueued.add();
+        {
+            lock_guard<mutex> lock(mtx);
+            events.push(move(event));
+        }
+        cv.notify_one();
+    }
+
+    bool waitAndDrain(vector<BroadcastEvent>& batch) {
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [this] { return !events.empty(); });
+        while (!events.empty()) {
+            batch.push_back(move(events.front()));
+            events.pop();
+            metrics.broadcastsDelivered.add();
+        }
+        return true;
+    }
+};
+
+// Seconds from releasing the producers until the consumer has every event
+template <typename Queue>
+double runOnce(int producers, size_t events) {
+    Queue queue;
+    promise<void> start;
+    shared_future<void> go = start.get_future().share();
+    size_t perProducer = events / producers;
+
+    vector<thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&queue, go, perProducer] {
+            go.wait();
+            for (size_t i = 0; i < perProducer; i++) queue.push(BroadcastEvent{});
+        });
+    }
+
+    auto begin = chrono::steady_clock::now();
+    start.set_value();
+    vector<BroadcastEvent> batch;
+    size_t received = 0;
+    while (received < perProducer * producers) {
+        queue.waitAndDrain(batch);
+        received += batch.size();
+        batch.clear();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    for (auto& t : threads) t.join();
+    return seconds;
+}
+
+template <typename Queue>
+void report(const char* name, int producers, size_t events) {
+    double best = 1e9;
+    for (int run = 0; run < RUNS; run++) best = min(best, runOnce<Queue>(producers, events));
+    size_t pushed = events / producers * producers;
+    printf("%-9d %-12s %10.2f %10.1f\n", producers, name, pushed / best / 1e6, best * 1e9 / pushed);
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    size_t events = argc > 1 ? (size_t)atoll(argv[1]) : DEFAULT_EVENTS;
+
+    printf("%zu events per run, best of %d, %u hardware threads\n", events, RUNS, thread::hardware_concurrency());
+    printf("%-9s %-12s %10s %10s\n", "producers", "queue", "Mevents/s", "ns/event");
+    for (int producers : {1, 8, 64, 512}) {
+        report<MutexQueue>("mutex", producers, events);
+        report<MessageQueue>("lock-free", producers, events);
+    }
+    return 0;
+}
@@ -0,0 +1,126 @@
+// bench/search_bench.cpp
+// /search over one room holding a million messages: what the word index
+// costs on every post, and what it saves per query against the substring
+// scan over every message that /search did before it.
+//
+//   search_bench [messages]
+#define CHAT_SERVER_NO_MAIN
+#include "main_server.cpp"
+
+#include <random>
+
+#define DEFAULT_MESSAGES 1000000  // history capacity
+#define FULL_ADDS 1000000         // at least this many are posted into the full history
+#define VOCABULARY 20000          // distinct words, drawn with Zipf frequencies
+#define QUERY_RUNS 5              // the best run of each query is reported
+
+mt19937 rng(1);
+
+string randomWord() {
+    string word(3 + rng() % 8, 'a');
+    for (auto& c : word) c = (char)('a' + rng() % 26);
+    return word;
+}
+
+// Chat-like lines of 6 to 12 words, common words far more common than rare ones
+class TextSource {
+private:
+    vector<string> words;
+    vector<double> cumulative;
+
+public:
+    TextSource() {
+        double total = 0;
+        for (int rank = 1; rank <= VOCABULARY; rank++) {
+            words.push_back(randomWord());
+            total += 1.0 / rank;
+            cumulative.push_back(total);
+        }
+    }
+
+    const string& word(size_t rank) const { return words[rank - 1]; }
+
+    string line() {
+        uniform_real_distribution<double> pick(0, cumulative.back());
+        string text;
+        for (int n = 6 + rng() % 7; n > 0; n--) {
+            size_t i = upper_bound(cumulative.begin(), cumulative.end(), pick(rng)) - cumulative.begin();
+            if (!text.empty()) text += ' ';
+            text += words[min(i, words.size() - 1)];
+        }
+        return text;
+    }
+};
+
+// /search before the word index: every message's text is scanned
+size_t scanSearch(const vector<MessageRef>& messages, const string& keyword) {
+    vector<MessageRef> result;
+    for (const auto& msg : messages) {
+        if (findSubstring(msg->text.data(), msg->text.size(), keyword.data(), keyword.size())) {
+            result.push_back(msg);
+        }
+    }
+    return result.size();
+}
+
+template <typename F>
+double bestMillis(F f) {
+    double best = 1e18;
+    for (int run = 0; run < QUERY_RUNS; run++) {
+        auto begin = chrono::steady_clock::now();
+        f();
+        best = min(best, chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count());
+    }
+    return best;
+}
+
+int main(int argc, char* argv[]) {
+    int capacity = argc > 1 ? atoi(argv[1]) : DEFAULT_MESSAGES;
+    Name sender = nameTable.intern("alice");
+    Name room = nameTable.intern("general");
+    TextSource source;
+    History history(capacity);
+
+    // Posting: first into an empty history, then into a full one, where
+    // every add evicts and the index has stale ids to compact
+    vector<MessageRef> live;
+    int nextId = 1;
+    for (bool full : {false, true}) {
+        int adds = full ? max(capacity, FULL_ADDS) : capacity;
+        double totalNanos = 0, worstNanos = 0;
+        for (int i = 0; i < adds; i++) {
+            MessageRef msg = MessageRef::create(nextId++, sender, source.line(), room);
+            auto begin = chrono::steady_clock::now();
+            history.addMessage(msg);
+            double nanos = chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count();
+            totalNanos += nanos;
+            worstNanos = max(worstNanos, nanos);
+        }
+        printf("%-14s %8.0f ns/message, slowest %.2f ms\n", full ? "add (full)" : "add (filling)", totalNanos / adds,
+               worstNanos / 1e6);
+    }
+    live = history.getMessages();
+
+    printf("\n%zu messages\n", live.size());
+    printf("%-22s %9s %12s %12s %9s\n", "query", "hits", "index ms", "scan ms", "speedup");
+    vector<pair<string, string>> queries = {
+        {"most common word", source.word(1)},
+        {"100th word", source.word(100)},
+        {"10000th word", source.word(10000)},
+        {"part of a word", source.word(1).substr(1, 2)},
+        {"no match", "qqqqqqqq"},
+        {"two words (scan)", source.word(1) + " " + source.word(2)},
+    };
+    for (const auto& query : queries) {
+        size_t hits = 0, scanHits = 0;
+        double indexed = bestMillis([&] { hits = history.searchMessages(query.second).size(); });
+        double scanned = bestMillis([&] { scanHits = scanSearch(live, query.second); });
+        if (hits != scanHits) {
+            cerr << "search_bench: '" << query.second << "' found " << hits << ", scan found " << scanHits << endl;
+            return 1;
+        }
+        printf("%-22s %9zu %12.2f %12.2f %8.1fx\n", query.first.c_str(), hits, indexed, scanned, scanned / indexed);
+        fflush(stdout);
+    }
+    return 0;
+}
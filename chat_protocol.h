@@ -0,0 +1,151 @@
+// chat_protocol.h
+// Length-prefixed framing shared by main_server.cpp and main_client.cpp
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// ==========================
+// Wire Format
+// ==========================
+//
+// Every frame is an 8-byte header followed by its payload. All integers are
+// big-endian.
+//
+//   uint32 length       payload bytes after the header
+//   uint8  type         FrameType
+//   uint8  flags        reserved, always 0
+//   uint16 targetLen    leading payload bytes naming the room or user
+//   char   target[targetLen]
+//   char   body[length - targetLen]
+//
+// Frames are capped at MAX_FRAME_SIZE, so the first byte a framed client
+// sends is always 0. Legacy text clients start with their username instead,
+// which is how the server tells the two apart.
+
+#define FRAME_HEADER_SIZE 8
+#define MAX_FRAME_SIZE (1024 * 1024)
+
+enum class FrameType : uint8_t {
+    Hello = 1,          // client -> server, body = username
+    Text = 2,           // client -> server, body = a chat line or /command
+    PrivateMessage = 3, // client -> server, target = user, body = text
+    Join = 4,           // client -> server, target = room, body = last message id seen (optional)
+    ServerText = 5,     // server -> client, body = text to display
+    Retract = 6,        // server -> client, target = room, body = id of a message its sender undid
+    ChatLine = 7        // server -> client, target = message id, body = text to display
+};
+
+// A decoded frame. The views point into the decoder's buffer and stay valid
+// until the next prepare() or feed().
+struct FrameView {
+    FrameType type;
+    std::string_view target;
+    std::string_view body;
+};
+
+inline void appendFrame(std::string& out, FrameType type, std::string_view target, std::string_view body) {
+    uint32_t length = (uint32_t)(target.size() + body.size());
+    unsigned char header[FRAME_HEADER_SIZE] = {
+        (unsigned char)(length >> 24), (unsigned char)(length >> 16),
+        (unsigned char)(length >> 8), (unsigned char)length,
+        (unsigned char)type, 0,
+        (unsigned char)(target.size() >> 8), (unsigned char)target.size()
+    };
+    out.append((const char*)header, FRAME_HEADER_SIZE);
+    out.append(target.data(), target.size());
+    out.append(body.data(), body.size());
+}
+
+inline std::string encodeFrame(FrameType type, std::string_view target, std::string_view body) {
+    std::string out;
+    out.reserve(FRAME_HEADER_SIZE + target.size() + body.size());
+    appendFrame(out, type, target, body);
+    return out;
+}
+
+// A message id as sent in "/join <room> since <id>" or a Join frame's body.
+// Clamped so that the server can add one to it. The client only splits
+// "since" off a room name when this accepts the rest, since the server
+// closes connections whose Join body is not an id.
+inline bool parseSinceId(std::string_view text, int& sinceId) {
+    std::string digits(text);
+    char* end;
+    long id = std::strtol(digits.c_str(), &end, 10);
+    if (digits.empty() || end == digits.c_str() || *end != '\0') return false;
+    sinceId = (int)std::max(-1L, std::min(id, (long)INT_MAX - 1));
+    return true;
+}
+
+// ==========================
+// Frame Decoder
+// ==========================
+
+// Incremental decoder that works on arbitrary split points. Callers recv()
+// straight into prepare()'s space and commit() what arrived, so payloads are
+// never copied; next() hands out views into the buffer.
+class FrameDecoder {
+private:
+    std::vector<char> buffer;
+    size_t start = 0;   // first unconsumed byte
+    size_t end = 0;     // one past the last received byte
+    bool failed = false;
+
+public:
+    // Returns at least minSpace writable bytes after the received data.
+    char* prepare(size_t minSpace, size_t& space) {
+        // Reclaim consumed bytes before growing
+        if (start > 0) {
+            memmove(buffer.data(), buffer.data() + start, end - start);
+            end -= start;
+            start = 0;
+        }
+        if (buffer.size() - end < minSpace) {
+            buffer.resize(end + minSpace);
+        }
+        space = buffer.size() - end;
+        return buffer.data() + end;
+    }
+
+    void commit(size_t received) {
+        end += received;
+    }
+
+    void feed(const char* data, size_t len) {
+        size_t space;
+        char* dest = prepare(len, space);
+        memcpy(dest, data, len);
+        commit(len);
+    }
+
+    // Pops the next complete frame. Returns false when more bytes are needed
+    // or the stream is malformed (see error()).
+    bool next(FrameView& frame) {
+        if (failed || end - start < FRAME_HEADER_SIZE) return false;
+
+        const unsigned char* h = (const unsigned char*)buffer.data() + start;
+        uint32_t length = ((uint32_t)h[0] << 24) | ((uint32_t)h[1] << 16) | ((uint32_t)h[2] << 8) | h[3];
+        uint16_t targetLen = (uint16_t)((h[6] << 8) | h[7]);
+
+        if (length > MAX_FRAME_SIZE || targetLen > length || h[5] != 0) {
+            failed = true;
+            return false;
+        }
+        if (end - start < FRAME_HEADER_SIZE + (size_t)length) return false;
+
+        const char* payload = buffer.data() + start + FRAME_HEADER_SIZE;
+        frame.type = (FrameType)h[4];
+        frame.target = std::string_view(payload, targetLen);
+        frame.body = std::string_view(payload + targetLen, length - targetLen);
+        start += FRAME_HEADER_SIZE + length;
+        return true;
+    }
+
+    bool error() const { return failed; }
+};
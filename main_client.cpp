@@ -2,77 +2,254 @@
 #include <iostream>
 #include <string>
 #include <thread>
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <windows.h>
 #include <atomic>
-
-
-#ifndef _WIN32
-
-#endif
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include "platform.h"
+#include "chat_protocol.h"
 
 
 using namespace std;
 
 #define DEFAULT_PORT 8080
+#define SCRIPT_BATCH_BYTES (64 * 1024)  // --script: frames coalesced into one send
+#define SCRIPT_LINGER_MS 250    // --script: quiet time after the last reply before exiting
+#define TEXT_SEND_GAP_MS 100    // --text: pause after each line so the server reads it on its own
 
 // Declare variables directly (no header needed)
 SOCKET sock = INVALID_SOCKET;
 atomic<bool> running(true);
 string username;
+bool framed = true;     // false with --text: legacy one-recv-per-message protocol
+bool scriptMode = false;    // --script: no prompts, stdin is a stream of lines
+FrameDecoder decoder;
 
-// Function to receive messages from server
+// Counts reads so --script can tell when the server has gone quiet
+mutex receivedMtx;
+condition_variable receivedCv;
+uint64_t receivedReads = 0;
+
+void displayMessage(const char* text, size_t len) {
+    if (scriptMode) {
+        cout.write(text, len);
+        if (len == 0 || text[len - 1] != '\n') cout << '\n';
+        return;
+    }
+    // Clear current line and display message
+    cout << "\r" << string(100, ' ') << "\r";  // Clear line
+    cout.write(text, len) << endl;
+    cout << "[" << username << "]> " << flush;  // Show username in prompt
+}
+
+// The bytes to send for one line typed by the user. In framed mode /pm and
+// /join carry their target in the frame header; everything else goes as a
+// Text frame.
+string encodeLine(const string& msg) {
+    if (!framed) return msg;
+
+    if (msg.rfind("/pm ", 0) == 0 && msg.find(' ', 4) != string::npos) {
+        size_t space = msg.find(' ', 4);
+        return encodeFrame(FrameType::PrivateMessage, string_view(msg).substr(4, space - 4), string_view(msg).substr(space + 1));
+    }
+    if (msg.rfind("/join ", 0) == 0) {
+        // "/join <room> since <id>" puts the id in the body; with anything
+        // but an id after "since" it is all the room name
+        string_view room = string_view(msg).substr(6);
+        size_t since = room.rfind(" since ");
+        int sinceId;
+        if (since != string_view::npos && parseSinceId(room.substr(since + 7), sinceId)) {
+            return encodeFrame(FrameType::Join, room.substr(0, since), room.substr(since + 7));
+        }
+        return encodeFrame(FrameType::Join, room, "");
+    }
+    return encodeFrame(FrameType::Text, "", msg);
+}
+
+bool sendAll(const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        int n = send(sock, data.data() + sent, (int)(data.size() - sent), 0);
+        if (n == SOCKET_ERROR) return false;
+        sent += (size_t)n;
+    }
+    return true;
+}
+
+// Receives until the connection ends. The socket is blocking, so an idle
+// client sleeps in recv(); main() wakes it with shutdown() on /quit.
 void receiveMessages() {
     char buffer[1024];
-    while (running) {
-        int valread = recv(sock, buffer, sizeof(buffer) - 1, 0);
-        if (valread > 0) {
-            buffer[valread] = '\0';
-            // Clear current line and display message
-            cout << "\r" << string(100, ' ') << "\r";  // Clear line
-            cout << buffer << endl;
-            cout << "[" << username << "]> " << flush;  // Show username in prompt
-        } else if (valread == 0) {
-            cout << "\n  Server disconnected." << endl;
-            running = false;
-            break;
+    while (true) {
+        int valread;
+        if (framed) {
+            size_t space;
+            char* dest = decoder.prepare(4096, space);
+            valread = recv(sock, dest, (int)space, 0);
         } else {
-            int error = WSAGetLastError();
-            if (error != WSAEWOULDBLOCK) {
-                cout << "\n Connection error: " << error << endl;
-                running = false;
+            valread = recv(sock, buffer, sizeof(buffer) - 1, 0);
+        }
+
+        if (valread > 0 && framed) {
+            decoder.commit(valread);
+            FrameView frame;
+            while (decoder.next(frame)) {
+                if (frame.type == FrameType::ServerText || frame.type == FrameType::ChatLine) {
+                    displayMessage(frame.body.data(), frame.body.size());
+                } else if (frame.type == FrameType::Retract) {
+                    // A console cannot take a printed line back, so say which one
+                    string notice = "(message #" + string(frame.body) + " was retracted by its sender)\n";
+                    displayMessage(notice.data(), notice.size());
+                }
+            }
+            if (decoder.error()) {
+                cout << "\n Protocol error from server." << endl;
                 break;
             }
+        } else if (valread > 0) {
+            displayMessage(buffer, valread);
+        } else if (valread == 0) {
+            if (running) cout << "\n  Server disconnected." << endl;
+            break;
+        } else {
+            if (running) cout << "\n Connection error: " << socketError() << endl;
+            break;
+        }
+        if (scriptMode) {
+            cout.flush();
+            lock_guard<mutex> lock(receivedMtx);
+            receivedReads++;
+            receivedCv.notify_all();
         }
     }
+    lock_guard<mutex> lock(receivedMtx);
+    running = false;
+    receivedCv.notify_all();
+    cout.flush();
 }
 
-int main() {
-    // Initialize Winsock
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-        cerr << "❌ WSAStartup failed." << endl;
-        return -1;
+// --script: sends stdin line by line without prompts or delays. Framed
+// lines already buffered on stdin go out together in one send. At the end
+// of input replies are printed until the server has been quiet for
+// SCRIPT_LINGER_MS; the server drops whatever it still had queued when the
+// connection closes, so hanging up right away would lose them.
+void runScript() {
+    string msg, pending;
+    while (running && getline(cin, msg)) {
+        if (!msg.empty() && msg.back() == '\r') msg.pop_back();
+        if (msg.empty()) continue;
+        if (msg == "/quit") break;
+
+        pending += encodeLine(msg);
+        if (pending.size() < SCRIPT_BATCH_BYTES && cin.rdbuf()->in_avail() > 0) continue;
+        if (!sendAll(pending)) {
+            cerr << " Send failed: " << socketError() << endl;
+            break;
+        }
+        pending.clear();
+    }
+    if (!pending.empty() && !sendAll(pending)) {
+        cerr << " Send failed: " << socketError() << endl;
+    }
+
+    unique_lock<mutex> lock(receivedMtx);
+    while (running) {
+        uint64_t seen = receivedReads;
+        if (!receivedCv.wait_for(lock, chrono::milliseconds(SCRIPT_LINGER_MS),
+                                 [&] { return receivedReads != seen || !running; })) {
+            break;
+        }
+    }
+    running = false;
+    lock.unlock();
+    shutdown(sock, SD_BOTH);
+}
+
+// Reads commands typed by the user until /quit or end of input
+void runInteractive() {
+    string msg;
+    while (running) {
+        cout << "[" << username << "]> " << flush;
+        if (!getline(cin, msg) || msg == "/quit") break;
+
+        if (!sendAll(encodeLine(msg))) {
+            cerr << " Send failed: " << socketError() << endl;
+            break;
+        }
+        // The text protocol is one recv() per message; lines pasted in one
+        // go would otherwise arrive as a single message
+        if (!framed) this_thread::sleep_for(chrono::milliseconds(TEXT_SEND_GAP_MS));
     }
+    running = false;
+    shutdown(sock, SD_BOTH);
+}
 
-    cout << "Enter your username: ";
-    getline(cin, username);
-    
+int main(int argc, char* argv[]) {
     string server_host;
-    int port;
+    int port = 0;
 
-    cout << "Enter server hostname/IP (e.g. 127.0.0.1): ";
-    getline(cin, server_host);
-    cout << "Enter server port (e.g. 8080): ";
-    cin >> port;
-    cin.ignore(); // clear newline from buffer
+    // --text   --script   --user=NAME   --host=HOST   --port=N
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--text") {
+            framed = false;     // talk to servers that predate framing
+        } else if (arg == "--script") {
+            scriptMode = true;
+        } else if (arg.rfind("--user=", 0) == 0) {
+            username = arg.substr(7);
+        } else if (arg.rfind("--host=", 0) == 0) {
+            server_host = arg.substr(7);
+        } else if (arg.rfind("--port=", 0) == 0) {
+            port = atoi(arg.c_str() + 7);
+        } else {
+            cerr << "Usage: " << argv[0] << " [--text] [--script] [--user=NAME] [--host=HOST] [--port=N]\n";
+            return 1;
+        }
+    }
+    if (scriptMode) {
+        // The text protocol cannot tell back-to-back lines apart: the server
+        // would read a whole batch (and the username before it) as one message
+        if (!framed) {
+            cerr << "--script needs the framed protocol; it cannot be used with --text" << endl;
+            return 1;
+        }
+        // stdin carries only chat lines, so nothing can be asked for
+        if (username.empty()) {
+            cerr << "--script needs --user=NAME" << endl;
+            return 1;
+        }
+        if (server_host.empty()) server_host = "127.0.0.1";
+        if (port == 0) port = DEFAULT_PORT;
+        // Lets runScript() see how much input is already buffered
+        ios::sync_with_stdio(false);
+    }
+
+    // Initialize sockets (Winsock on Windows)
+    if (!socketsInit()) {
+        cerr << "❌ WSAStartup failed." << endl;
+        return -1;
+    }
+
+    if (username.empty()) {
+        cout << "Enter your username: ";
+        getline(cin, username);
+    }
+    if (server_host.empty()) {
+        cout << "Enter server hostname/IP (e.g. 127.0.0.1): ";
+        getline(cin, server_host);
+    }
+    if (port == 0) {
+        cout << "Enter server port (e.g. 8080): ";
+        cin >> port;
+        cin.ignore(); // clear newline from buffer
+    }
 
     // Create socket
     sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock == INVALID_SOCKET) {
-        cerr << " Socket creation error: " << WSAGetLastError() << endl;
-        WSACleanup();
+        cerr << " Socket creation error: " << socketError() << endl;
+        socketsCleanup();
         return -1;
     }
 
@@ -86,7 +263,7 @@ int main() {
         if (!he) {
             cerr << " Host not found: " << server_host << endl;
             closesocket(sock);
-            WSACleanup();
+            socketsCleanup();
             return -1;
         }
         memcpy(&serv_addr.sin_addr, he->h_addr_list[0], he->h_length);
@@ -94,62 +271,47 @@ int main() {
 
     // Connect to server
     if (connect(sock, (sockaddr*)&serv_addr, sizeof(serv_addr)) == SOCKET_ERROR) {
-        cerr << " Connection failed: " << WSAGetLastError() << endl;
+        cerr << " Connection failed: " << socketError() << endl;
         closesocket(sock);
-        WSACleanup();
+        socketsCleanup();
         return -1;
     }
 
     // Send username to server immediately
-    send(sock, username.c_str(), username.size(), 0);
+    sendAll(framed ? encodeFrame(FrameType::Hello, "", username) : username);
+    if (!framed) this_thread::sleep_for(chrono::milliseconds(TEXT_SEND_GAP_MS));
+
+    if (scriptMode) {
+        thread recvThread(receiveMessages);
+        runScript();
+        recvThread.join();
+        closesocket(sock);
+        socketsCleanup();
+        return 0;
+    }
 
     cout << "==========================================" << endl;
     cout << "          CHAT APPLICATION COMMANDS       " << endl;
     cout << "==========================================" << endl;
-    cout << "/join <room>           - Join or create a chat room" << endl;
+    cout << "/join <room> [since n] - Join or create a chat room (and get its messages after #n)" << endl;
     cout << "/pm <user> <message>   - Send private message to a user" << endl;
     cout << "/reply <user> <msg>    - Reply to a user in the current room" << endl;
     cout << "/undo                  - Undo your last message" << endl;
     cout << "/redo                  - Redo your last undone message" << endl;
-    cout << "/history               - Show message history for current room" << endl;
+    cout << "/history [n] [id]      - Show the last n messages of this room (older than message #id)" << endl;
     cout << "/search <keyword>      - Search for messages containing keyword" << endl;
     cout << "/quit                  - Exit the chat application" << endl;
     cout << "/help                  - Show this help message" << endl;
     cout << "==========================================" << endl;
 
-
-    // Make socket non-blocking
-
-    u_long mode = 1;
-    ioctlsocket(sock, FIONBIO, &mode);
-
     // Start receiving thread
     thread recvThread(receiveMessages);
-
-    string msg;
-    while (running) {
-        cout << "[" << username << "]> " << flush;
-        getline(cin, msg);
-
-        if (msg == "/quit") {
-            running = false;
-            break;
-        }
-
-        if (send(sock, msg.c_str(), msg.size(), 0) == SOCKET_ERROR) {
-            cerr << " Send failed: " << WSAGetLastError() << endl;
-            running = false;
-            break;
-        }
-
-        Sleep(100); // small delay
-    }
+    runInteractive();
 
     // Cleanup
-    running = false;
     if (recvThread.joinable()) recvThread.join();
     closesocket(sock);
-    WSACleanup();
+    socketsCleanup();
 
     cout << username + " Disconnected from server." << endl;
     return 0;
@@ -0,0 +1,641 @@
+// main_loadgen.cpp
+// Headless load generator: N framed clients in M rooms send timestamped
+// chat lines at a fixed total rate and measure delivery latency. With
+// --rate=0 they only connect and stay idle, to measure what each idle
+// connection costs the server.
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#ifndef __linux__
+#error "main_loadgen.cpp uses epoll and /proc and only builds on Linux"
+#endif
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <cerrno>
+#include <time.h>
+
+#include "chat_protocol.h"
+
+using namespace std;
+
+#define DEFAULT_PORT 8080
+#define PAYLOAD_TAG "lg "          // chat lines sent by the generator start with this
+#define HISTOGRAM_SUB_BUCKETS 128  // per power of two, about 1% precision
+#define DRAIN_SECONDS 1            // keep reading after the last send
+#define FLOOD_BACKLOG (256 * 1024) // unsent bytes a flood user may pile up
+
+// ==========================
+// Options
+// ==========================
+
+struct Options {
+    string host = "127.0.0.1";
+    int port = DEFAULT_PORT;
+    int users = 100;
+    int rooms = 10;
+    double rate = 1000;         // messages per second, all users together
+    double duration = 10;       // measured seconds
+    double warmup = 2;          // seconds sent but not measured
+    size_t size = 64;           // message text bytes
+    int threads = 2;
+    int serverPid = 0;          // for CPU and RSS, 0 to skip
+    int metricsPort = 0;        // server's --metrics-port, for its send() count; 0 to skip
+    int churnUsers = 0;         // extra users that only hop between rooms
+    double churnRate = 0;       // room changes per second, all churn users together
+    int floodUsers = 0;         // extra users that send untimed lines as fast as floodRate
+    double floodRate = 0;       // lines per second, all flood users together
+};
+
+// ==========================
+// Latency Histogram
+// ==========================
+
+// Log-linear histogram in the style of HdrHistogram: each power of two is
+// split into HISTOGRAM_SUB_BUCKETS linear buckets, so every recorded value
+// keeps about two significant digits. Values are in nanoseconds.
+class Histogram {
+private:
+    vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t maxValue = 0;
+    double sum = 0;
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < HISTOGRAM_SUB_BUCKETS) return (size_t)value;
+        int magnitude = 63 - __builtin_clzll(value) - 6;   // log2(HISTOGRAM_SUB_BUCKETS / 2)
+        return (size_t)magnitude * (HISTOGRAM_SUB_BUCKETS / 2) + (size_t)(value >> magnitude);
+    }
+
+    // Highest value that lands in bucket
+    static uint64_t valueOf(size_t bucket) {
+        if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+        size_t magnitude = bucket / (HISTOGRAM_SUB_BUCKETS / 2) - 1;
+        uint64_t sub = bucket - magnitude * (HISTOGRAM_SUB_BUCKETS / 2);
+        return ((sub + 1) << magnitude) - 1;
+    }
+
+public:
+    Histogram() : counts(bucketOf(UINT64_MAX) + 1) {}
+
+    void record(uint64_t value) {
+        counts[bucketOf(value)]++;
+        total++;
+        sum += (double)value;
+        maxValue = std::max(maxValue, value);
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < counts.size(); i++) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        maxValue = std::max(maxValue, other.maxValue);
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t maxRecorded() const { return maxValue; }
+    double mean() const { return total ? sum / total : 0; }
+
+    uint64_t percentile(double p) const {
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)ceil(p / 100.0 * total);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= rank) return std::min(valueOf(i), maxValue);
+        }
+        return maxValue;
+    }
+};
+
+// ==========================
+// Clock
+// ==========================
+
+uint64_t nowNanos() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// ==========================
+// Simulated Users
+// ==========================
+
+struct User {
+    int fd = -1;
+    string name;
+    FrameDecoder decoder;
+    string outbuf;          // bytes the socket did not take yet
+};
+
+struct WorkerStats {
+    Histogram latency;
+    uint64_t sent = 0;
+    uint64_t delivered = 0;
+    uint64_t sendErrors = 0;
+    uint64_t disconnects = 0;
+    uint64_t joins = 0;
+};
+
+// Only messages scheduled inside [measureFrom, measureUntil) are counted
+uint64_t measureFrom = 0;
+uint64_t measureUntil = 0;
+
+int connectUser(const Options& opt, User& user, int room) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    if (inet_pton(AF_INET, opt.host.c_str(), &addr.sin_addr) <= 0 ||
+        connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // Greeting and room are sent before switching to non-blocking
+    string hello = encodeFrame(FrameType::Hello, "", user.name);
+    appendFrame(hello, FrameType::Join, "room" + to_string(room), "");
+    if (send(fd, hello.data(), hello.size(), 0) != (ssize_t)hello.size()) {
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    user.fd = fd;
+    return 0;
+}
+
+bool flushUser(User& user, WorkerStats& stats) {
+    while (!user.outbuf.empty()) {
+        ssize_t n = send(user.fd, user.outbuf.data(), user.outbuf.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            stats.sendErrors++;
+            return false;
+        }
+        user.outbuf.erase(0, (size_t)n);
+    }
+    return true;
+}
+
+// Chat lines look like "[HH:MM:SS][user]: lg <nanos> ...". Anything else
+// (joins, acknowledgements) is ignored.
+void onFrame(const FrameView& frame, WorkerStats& stats, uint64_t now) {
+    if (frame.type != FrameType::ChatLine) return;
+
+    size_t tag = frame.body.find("]: " PAYLOAD_TAG);
+    if (tag == string_view::npos) return;
+
+    string_view stamp = frame.body.substr(tag + 3 + strlen(PAYLOAD_TAG));
+    uint64_t sentAt = strtoull(string(stamp.substr(0, 20)).c_str(), nullptr, 10);
+    if (sentAt < measureFrom || sentAt >= measureUntil) return;
+
+    stats.delivered++;
+    stats.latency.record(now > sentAt ? now - sentAt : 0);
+}
+
+bool readUser(User& user, WorkerStats& stats) {
+    while (true) {
+        size_t space;
+        char* dest = user.decoder.prepare(16 * 1024, space);
+        ssize_t n = recv(user.fd, dest, space, 0);
+        if (n > 0) {
+            user.decoder.commit((size_t)n);
+            uint64_t now = nowNanos();
+            FrameView frame;
+            while (user.decoder.next(frame)) onFrame(frame, stats, now);
+            if (user.decoder.error()) return false;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        return false;
+    }
+}
+
+// Owns a slice of the users. Sends are paced on a fixed schedule; each
+// message carries its scheduled time rather than the time it actually
+// left, so a stalled server shows up as latency instead of being hidden
+// by a slower send rate. A timerfd wakes the loop for the next send, since
+// epoll_wait's millisecond timeout would either spin or send late.
+void runWorker(const Options& opt, vector<User>* users, double rate, uint64_t drainUntil, WorkerStats* stats) {
+    const uint64_t TIMER_TOKEN = UINT64_MAX;
+    int epfd = epoll_create1(0);
+    int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    for (size_t i = 0; i < users->size(); i++) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, (*users)[i].fd, &ev);
+    }
+    epoll_event timerEv{};
+    timerEv.events = EPOLLIN;
+    timerEv.data.u64 = TIMER_TOKEN;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &timerEv);
+
+    string padding(opt.size > 24 ? opt.size - 24 : 0, 'x');
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 / rate) : UINT64_MAX;
+    uint64_t nextSend = nowNanos();
+    size_t nextUser = 0;
+    epoll_event events[256];
+
+    while (true) {
+        uint64_t now = nowNanos();
+        if (now >= drainUntil) break;
+
+        // Catch up on every send that is due
+        while (nextSend <= now && nextSend < measureUntil && interval != UINT64_MAX) {
+            User& user = (*users)[nextUser];
+            nextUser = (nextUser + 1) % users->size();
+            if (user.fd >= 0) {
+                string text = PAYLOAD_TAG + to_string(nextSend) + " " + padding;
+                appendFrame(user.outbuf, FrameType::Text, "", text);
+                if (nextSend >= measureFrom) stats->sent++;
+                if (!flushUser(user, *stats)) {
+                    close(user.fd);
+                    user.fd = -1;
+                    stats->disconnects++;
+                }
+            }
+            nextSend += interval;
+        }
+
+        uint64_t wakeAt = nextSend < measureUntil && interval != UINT64_MAX ? nextSend : drainUntil;
+        itimerspec timer{};
+        timer.it_value.tv_sec = (time_t)(wakeAt / 1000000000);
+        timer.it_value.tv_nsec = (long)(wakeAt % 1000000000);
+        timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &timer, nullptr);
+
+        int n = epoll_wait(epfd, events, 256, 100);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u64 == TIMER_TOKEN) {
+                uint64_t expirations;
+                if (read(timerfd, &expirations, sizeof(expirations)) < 0) {}
+                continue;
+            }
+            User& user = (*users)[events[i].data.u64];
+            if (user.fd < 0) continue;
+            if (!readUser(user, *stats) || !flushUser(user, *stats)) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, user.fd, nullptr);
+                close(user.fd);
+                user.fd = -1;
+                stats->disconnects++;
+            }
+        }
+    }
+    close(timerfd);
+    close(epfd);
+}
+
+// Reads and discards everything a background user received. False once
+// the server closed the connection; the user is then closed too.
+bool discardInput(User& user, WorkerStats& stats) {
+    char sink[16 * 1024];
+    ssize_t n;
+    while ((n = recv(user.fd, sink, sizeof(sink), 0)) > 0) {}
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        close(user.fd);
+        user.fd = -1;
+        stats.disconnects++;
+        return false;
+    }
+    return true;
+}
+
+// Membership churn: a separate set of users that keep switching rooms while
+// the others chat, so joins and leaves contend with broadcasts. They read
+// and discard everything they receive so the server never drops them.
+void runChurn(const Options& opt, vector<User>* users, uint64_t drainUntil, WorkerStats* stats) {
+    uint64_t interval = (uint64_t)(1e9 / opt.churnRate);
+    uint64_t nextJoin = nowNanos();
+    uint64_t issued = 0;
+
+    while (nowNanos() < drainUntil) {
+        uint64_t now = nowNanos();
+        while (nextJoin <= now && nextJoin < measureUntil) {
+            // User i moves one room further every round: room (i + round + 1)
+            size_t index = issued % users->size();
+            size_t round = issued / users->size();
+            issued++;
+            User& user = (*users)[index];
+            if (user.fd >= 0) {
+                string room = "room" + to_string((index + round + 1) % opt.rooms);
+                appendFrame(user.outbuf, FrameType::Join, room, "");
+                if (nextJoin >= measureFrom) stats->joins++;
+                if (!flushUser(user, *stats)) {
+                    close(user.fd);
+                    user.fd = -1;
+                    stats->disconnects++;
+                }
+            }
+            nextJoin += interval;
+        }
+
+        for (User& user : *users) {
+            if (user.fd >= 0) discardInput(user, *stats);
+        }
+
+        uint64_t wakeAt = min(nextJoin < measureUntil ? nextJoin : drainUntil, nowNanos() + 1000000);
+        this_thread::sleep_until(chrono::steady_clock::time_point(chrono::nanoseconds(wakeAt)));
+    }
+}
+
+// Flooding: a separate set of users that post into the same rooms at
+// floodRate, to see whether the server's rate limits keep the others'
+// latency down. Their lines carry no timestamp, so they are never counted
+// as deliveries. When the server pushes back, lines are skipped rather
+// than buffered without bound.
+void runFlood(const Options& opt, vector<User>* users, uint64_t drainUntil, WorkerStats* stats) {
+    uint64_t interval = (uint64_t)(1e9 / opt.floodRate);
+    uint64_t nextSend = nowNanos();
+    size_t nextUser = 0;
+    string text = "flood " + string(opt.size > 6 ? opt.size - 6 : 0, 'f');
+
+    while (nowNanos() < drainUntil) {
+        uint64_t now = nowNanos();
+        while (nextSend <= now && nextSend < measureUntil) {
+            User& user = (*users)[nextUser];
+            nextUser = (nextUser + 1) % users->size();
+            if (user.fd >= 0 && user.outbuf.size() < FLOOD_BACKLOG) {
+                appendFrame(user.outbuf, FrameType::Text, "", text);
+                if (nextSend >= measureFrom) stats->sent++;
+            }
+            nextSend += interval;
+        }
+
+        for (User& user : *users) {
+            if (user.fd < 0 || !discardInput(user, *stats)) continue;
+            if (!flushUser(user, *stats)) {
+                close(user.fd);
+                user.fd = -1;
+                stats->disconnects++;
+            }
+        }
+
+        uint64_t wakeAt = min(nextSend < measureUntil ? nextSend : drainUntil, nowNanos() + 1000000);
+        this_thread::sleep_until(chrono::steady_clock::time_point(chrono::nanoseconds(wakeAt)));
+    }
+}
+
+// ==========================
+// Server Usage (/proc)
+// ==========================
+
+struct ProcessUsage {
+    double cpuSeconds = -1;
+    long rssKb = -1;
+    long peakRssKb = -1;
+};
+
+ProcessUsage readUsage(int pid) {
+    ProcessUsage usage;
+    if (pid <= 0) return usage;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if (FILE* f = fopen(path, "r")) {
+        char buf[1024];
+        size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+        buf[len] = '\0';
+        fclose(f);
+        // utime and stime are fields 14 and 15, counted after the ")" that ends comm
+        const char* p = strrchr(buf, ')');
+        unsigned long long utime = 0, stime = 0;
+        if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) == 2) {
+            usage.cpuSeconds = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+        }
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if (FILE* f = fopen(path, "r")) {
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            sscanf(line, "VmRSS: %ld kB", &usage.rssKb);
+            sscanf(line, "VmHWM: %ld kB", &usage.peakRssKb);
+        }
+        fclose(f);
+    }
+    return usage;
+}
+
+// Reads one counter from the server's metrics endpoint, -1 if unavailable
+double readServerMetric(const Options& opt, const char* name) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.metricsPort);
+    inet_pton(AF_INET, opt.host.c_str(), &addr.sin_addr);
+    string page;
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0) {
+        const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+        if (send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL) > 0) {
+            char buf[4096];
+            ssize_t n;
+            while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) page.append(buf, (size_t)n);
+        }
+    }
+    close(fd);
+
+    string key = string("\n") + name + " ";
+    size_t at = page.find(key);
+    return at == string::npos ? -1 : atof(page.c_str() + at + key.size());
+}
+
+// ==========================
+// Main
+// ==========================
+
+void printUsage() {
+    cerr << "Usage: loadgen [--host=ADDR] [--port=N] [--users=N] [--rooms=M] [--rate=MSGS_PER_SEC]\n"
+            "               [--duration=SEC] [--warmup=SEC] [--size=BYTES] [--threads=N] [--server-pid=PID]\n"
+            "               [--churn-users=K --churn-rate=JOINS_PER_SEC] [--flood-users=K --flood-rate=MSGS_PER_SEC]\n"
+            "               [--metrics-port=N]\n";
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        string key = arg.substr(0, eq);
+        string value = eq == string::npos ? "" : arg.substr(eq + 1);
+
+        if (key == "--host") opt.host = value;
+        else if (key == "--port") opt.port = atoi(value.c_str());
+        else if (key == "--users") opt.users = max(1, atoi(value.c_str()));
+        else if (key == "--rooms") opt.rooms = max(1, atoi(value.c_str()));
+        else if (key == "--rate") opt.rate = atof(value.c_str());
+        else if (key == "--duration") opt.duration = atof(value.c_str());
+        else if (key == "--warmup") opt.warmup = atof(value.c_str());
+        else if (key == "--size") opt.size = (size_t)atol(value.c_str());
+        else if (key == "--threads") opt.threads = max(1, atoi(value.c_str()));
+        else if (key == "--server-pid") opt.serverPid = atoi(value.c_str());
+        else if (key == "--metrics-port") opt.metricsPort = atoi(value.c_str());
+        else if (key == "--churn-users") opt.churnUsers = max(0, atoi(value.c_str()));
+        else if (key == "--churn-rate") opt.churnRate = atof(value.c_str());
+        else if (key == "--flood-users") opt.floodUsers = max(0, atoi(value.c_str()));
+        else if (key == "--flood-rate") opt.floodRate = atof(value.c_str());
+        else {
+            printUsage();
+            return 1;
+        }
+    }
+    opt.threads = min(opt.threads, opt.users);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Thousands of users need more descriptors than the usual soft limit
+    rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+    ProcessUsage unconnected = readUsage(opt.serverPid);
+
+    // Users are dealt round-robin to rooms and to worker threads
+    vector<vector<User>> slices(opt.threads);
+    for (int i = 0; i < opt.users; i++) {
+        User user;
+        user.name = "lg" + to_string(i);
+        if (connectUser(opt, user, i % opt.rooms) != 0) {
+            cerr << "Could not connect user " << i << " to " << opt.host << ":" << opt.port << ": " << strerror(errno) << endl;
+            return 1;
+        }
+        slices[i % opt.threads].push_back(move(user));
+    }
+    vector<User> churners(opt.churnRate > 0 ? opt.churnUsers : 0);
+    for (size_t i = 0; i < churners.size(); i++) {
+        churners[i].name = "churn" + to_string(i);
+        if (connectUser(opt, churners[i], (int)i % opt.rooms) != 0) {
+            cerr << "Could not connect churn user " << i << ": " << strerror(errno) << endl;
+            return 1;
+        }
+    }
+    vector<User> flooders(opt.floodRate > 0 ? opt.floodUsers : 0);
+    for (size_t i = 0; i < flooders.size(); i++) {
+        flooders[i].name = "flood" + to_string(i);
+        if (connectUser(opt, flooders[i], (int)i % opt.rooms) != 0) {
+            cerr << "Could not connect flood user " << i << ": " << strerror(errno) << endl;
+            return 1;
+        }
+    }
+    cerr << "Connected " << opt.users << " users in " << opt.rooms << " rooms" << endl;
+
+    measureFrom = nowNanos() + (uint64_t)(opt.warmup * 1e9);
+    measureUntil = measureFrom + (uint64_t)(opt.duration * 1e9);
+    uint64_t drainUntil = measureUntil + DRAIN_SECONDS * 1000000000ull;
+
+    vector<WorkerStats> stats(opt.threads);
+    vector<thread> workers;
+    for (int t = 0; t < opt.threads; t++) {
+        double share = opt.rate * slices[t].size() / opt.users;
+        workers.emplace_back(runWorker, cref(opt), &slices[t], share, drainUntil, &stats[t]);
+    }
+    WorkerStats churnStats;
+    if (!churners.empty()) {
+        workers.emplace_back(runChurn, cref(opt), &churners, drainUntil, &churnStats);
+    }
+    WorkerStats floodStats;
+    if (!flooders.empty()) {
+        workers.emplace_back(runFlood, cref(opt), &flooders, drainUntil, &floodStats);
+    }
+
+    // Server usage is sampled over the measured window only
+    auto at = [](uint64_t nanos) { return chrono::steady_clock::time_point(chrono::nanoseconds(nanos)); };
+    this_thread::sleep_until(at(measureFrom));
+    ProcessUsage before = readUsage(opt.serverPid);
+    double sendCallsBefore = opt.metricsPort > 0 ? readServerMetric(opt, "chat_send_calls_total") : -1;
+    double limitedBefore = opt.metricsPort > 0 ? readServerMetric(opt, "chat_rate_limited_user_total") : -1;
+    this_thread::sleep_until(at(measureUntil));
+    ProcessUsage after = readUsage(opt.serverPid);
+    double sendCallsAfter = opt.metricsPort > 0 ? readServerMetric(opt, "chat_send_calls_total") : -1;
+    double limitedAfter = opt.metricsPort > 0 ? readServerMetric(opt, "chat_rate_limited_user_total") : -1;
+    double elapsed = opt.duration;
+
+    for (auto& worker : workers) worker.join();
+
+    WorkerStats total;
+    for (const auto& s : stats) {
+        total.latency.merge(s.latency);
+        total.sent += s.sent;
+        total.delivered += s.delivered;
+        total.sendErrors += s.sendErrors;
+        total.disconnects += s.disconnects;
+    }
+    total.disconnects += churnStats.disconnects + floodStats.disconnects;
+    for (auto& slice : slices) {
+        for (auto& user : slice) if (user.fd >= 0) close(user.fd);
+    }
+    for (auto& user : churners) if (user.fd >= 0) close(user.fd);
+    for (auto& user : flooders) if (user.fd >= 0) close(user.fd);
+
+    // One JSON object on stdout; microseconds for latencies
+    const Histogram& h = total.latency;
+    auto us = [](double nanos) { return nanos / 1000.0; };
+    printf("{\"users\":%d,\"rooms\":%d,\"target_rate\":%.1f,\"size\":%zu,\"duration_s\":%.3f,"
+           "\"sent\":%llu,\"delivered\":%llu,\"send_rate\":%.1f,\"delivery_rate\":%.1f,"
+           "\"send_errors\":%llu,\"disconnects\":%llu,"
+           "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p99_9\":%.1f,\"p99_99\":%.1f,\"max\":%.1f}",
+           opt.users, opt.rooms, opt.rate, opt.size, elapsed,
+           (unsigned long long)total.sent, (unsigned long long)total.delivered,
+           total.sent / elapsed, total.delivered / elapsed,
+           (unsigned long long)total.sendErrors, (unsigned long long)total.disconnects,
+           us(h.mean()), us((double)h.percentile(50)), us((double)h.percentile(90)), us((double)h.percentile(99)),
+           us((double)h.percentile(99.9)), us((double)h.percentile(99.99)), us((double)h.maxRecorded()));
+    if (sendCallsBefore >= 0 && sendCallsAfter >= 0) {
+        // Includes joins, acknowledgements and churn traffic, not only chat lines
+        double calls = sendCallsAfter - sendCallsBefore;
+        printf(",\"server_send_calls\":%.0f,\"send_calls_per_delivery\":%.3f",
+               calls, total.delivered > 0 ? calls / total.delivered : 0.0);
+    }
+    if (!churners.empty()) {
+        printf(",\"churn\":{\"users\":%zu,\"joins\":%llu,\"join_rate\":%.1f}",
+               churners.size(), (unsigned long long)churnStats.joins, churnStats.joins / elapsed);
+    }
+    if (!flooders.empty()) {
+        printf(",\"flood\":{\"users\":%zu,\"sent\":%llu,\"send_rate\":%.1f",
+               flooders.size(), (unsigned long long)floodStats.sent, floodStats.sent / elapsed);
+        // Includes any well-behaved user the server limited, which should be none
+        if (limitedBefore >= 0 && limitedAfter >= 0) printf(",\"server_rate_limited\":%.0f", limitedAfter - limitedBefore);
+        printf("}");
+    }
+    if (opt.rate <= 0 && unconnected.rssKb >= 0 && after.rssKb >= 0) {
+        // Idle connections: what the server holds per connected user
+        printf(",\"idle\":{\"connections\":%d,\"server_rss_kb_before\":%ld,\"server_rss_kb\":%ld,"
+               "\"server_kb_per_connection\":%.1f}",
+               opt.users + (int)(churners.size() + flooders.size()), unconnected.rssKb, after.rssKb,
+               (double)(after.rssKb - unconnected.rssKb) / (opt.users + churners.size() + flooders.size()));
+    }
+    if (opt.serverPid > 0 && before.cpuSeconds >= 0 && after.cpuSeconds >= 0) {
+        double cpu = after.cpuSeconds - before.cpuSeconds;
+        printf(",\"server\":{\"pid\":%d,\"cpu_s\":%.2f,\"cpu_pct\":%.1f,\"cpu_us_per_delivery\":%.2f,"
+               "\"rss_kb\":%ld,\"peak_rss_kb\":%ld}",
+               opt.serverPid, cpu, 100.0 * cpu / elapsed,
+               total.delivered > 0 ? cpu * 1e6 / total.delivered : 0.0, after.rssKb, after.peakRssKb);
+    }
+    printf("}\n");
+    return 0;
+}
@@ -4,555 +4,3844 @@
 #include <thread>   //for multiple user
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <mutex>    // for locking 
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include <shared_mutex>
+#include <condition_variable>
 #include <ctime>     // real time 
 #include <stack>      // for undo and redo message storage 
 #include <queue>
 #include <list>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
 #include <iomanip>
 #include <sstream>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <cctype>
+#include <string_view>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>     // _BitScanForward / _BitScanReverse64
+#endif
+
+#include "platform.h"
+
+#ifndef _WIN32
+// The message log maps its segments
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// The io_uring engine needs multishot accept/receive and provided buffer
+// rings (Linux 6.0 headers); with older headers only epoll is built.
+// IORING_REGISTER_PBUF_RING is an enum, but came before IORING_RECV_MULTISHOT.
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT) && defined(IORING_SETUP_COOP_TASKRUN)
+// The io_uring engine talks to the kernel through raw system calls
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#include "chat_protocol.h"
 
-#pragma comment(lib, "ws2_32.lib")
 using namespace std;
 
-#define PORT 8080
+#define PORT 8080                 // listening port unless --port is given
 #define MAX_MESSAGE_HISTORY 1000  // Maximum messages to keep in history
+#define TOKEN_COMPACT_MIN 64      // /search index: removed messages tolerated before compacting
+#define HISTORY_PAGE_SIZE 50      // /history without a count
+#define HISTORY_PAGE_BYTES (64 * 1024)    // cap on one /history page
+#define HISTORY_CHUNK_SIZE (16 * 1024)    // /history is sent in pieces of about this size
+#define DEFAULT_REACTOR_THREADS 2 // epoll threads when --reactors is not given
+#define DEFAULT_OUTBOUND_LIMIT (256 * 1024)  // queued bytes per client before the overflow policy kicks in
+#define DEFAULT_FLUSH_BYTES (16 * 1024)      // batched output is written early once this much is pending
+#define MAX_GATHER_BUFFERS 64     // queued buffers per gathered write
+#define URING_ENTRIES 1024        // submission queue size of each io_uring reactor
+#define URING_RECV_BUFFERS 256    // provided receive buffers per io_uring reactor (power of two)
+#define URING_RECV_BUFFER_SIZE 4096
+#define POOLED_TEXT_CAPACITY 4096 // recycled messages keep text buffers up to this size
+#define UNDO_DEPTH 32             // /undo steps kept per session
+#define METRIC_SHARDS 16          // cache lines per counter; threads are spread over them
+#define REGISTRY_SHARDS 16        // lock shards of the user, room and connection registries
 
 // ==========================
 // Utility Functions
 // ==========================
 
+// "HH:MM:SS" for the current second. localtime and strftime only run when
+// the second changes; each thread keeps its own copy, so reading it never
+// takes a lock.
+class Clock {
+private:
+    struct Cache {
+        time_t second = -1;
+        char text[8];
+    };
+
+    static const Cache& current() {
+        thread_local Cache cache;
+        time_t now = time(nullptr);
+        if (now != cache.second) {
+            tm local;
+            localTime(now, local);
+            char buffer[16];
+            strftime(buffer, sizeof(buffer), "%H:%M:%S", &local);
+            memcpy(cache.text, buffer, sizeof(cache.text));
+            cache.second = now;
+        }
+        return cache;
+    }
+
+public:
+    static void appendTime(string& out) {
+        out.append(current().text, sizeof(Cache::text));
+    }
+};
+
 string getCurrentTimeString() {
-    time_t now = time(nullptr);
-    tm localTime;
-    localtime_s(&localTime, &now);
-    
-    char buffer[20];
-    strftime(buffer, sizeof(buffer), "%H:%M:%S", &localTime);
-    return string(buffer);
+    string time;
+    Clock::appendTime(time);
+    return time;
+}
+
+// Appends "[HH:MM:SS][sender]: message" to out without temporaries
+void appendMessageWithTime(string& out, const string& sender, const string& message) {
+    out.reserve(out.size() + sender.size() + message.size() + 16);
+    out += '[';
+    Clock::appendTime(out);
+    out += "][";
+    out += sender;
+    out += "]: ";
+    out += message;
 }
 
 string formatMessageWithTime(const string& sender, const string& message) {
-    return "[" + getCurrentTimeString() + "][" + sender + "]: " + message;
+    string out;
+    appendMessageWithTime(out, sender, message);
+    return out;
+}
+
+// Index of the highest set bit; value must not be 0
+inline int highestBit(uint64_t value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (int)index;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+// Index of the lowest set bit; value must not be 0
+inline unsigned lowestBit(uint32_t value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctz(value);
+#endif
+}
+
+// ==========================
+// Metrics
+// ==========================
+
+inline uint64_t monotonicNanos() {
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Each thread is given one of METRIC_SHARDS slots the first time it records
+// something, so threads on a hot path do not bounce the same cache line.
+inline size_t metricShard() {
+    static atomic<size_t> nextShard{0};
+    thread_local size_t shard = nextShard.fetch_add(1) % METRIC_SHARDS;
+    return shard;
 }
 
+// Monotonic count, summed over the shards when read
+class Counter {
+private:
+    struct alignas(64) Shard {
+        atomic<uint64_t> value{0};
+    };
+    Shard shards[METRIC_SHARDS];
+
+public:
+    void add(uint64_t n = 1) {
+        shards[metricShard()].value.fetch_add(n, memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        uint64_t total = 0;
+        for (const auto& shard : shards) total += shard.value.load(memory_order_relaxed);
+        return total;
+    }
+};
+
+// Durations in power-of-two nanosecond buckets: bucket b counts values
+// below 2^b. Quantiles are therefore upper bounds within a factor of two,
+// which is enough to spot a lock or a fan-out going bad.
+class LatencyHistogram {
+public:
+    static const int BUCKETS = 40;  // the last one also takes everything above 2^39 ns
+
+    struct Snapshot {
+        uint64_t counts[BUCKETS] = {};
+        uint64_t count = 0;
+        uint64_t sumNanos = 0;
+
+        // Upper bound of the bucket holding quantile q, in nanoseconds
+        uint64_t quantile(double q) const {
+            uint64_t rank = (uint64_t)(q * count);
+            uint64_t seen = 0;
+            for (int b = 0; b < BUCKETS; b++) {
+                seen += counts[b];
+                if (seen > rank) return 1ull << b;
+            }
+            return 1ull << (BUCKETS - 1);
+        }
+    };
+
+private:
+    struct alignas(64) Shard {
+        atomic<uint64_t> counts[BUCKETS];
+        atomic<uint64_t> sumNanos{0};
+
+        Shard() {
+            for (auto& count : counts) count.store(0, memory_order_relaxed);
+        }
+    };
+    Shard shards[METRIC_SHARDS];
+
+public:
+    void record(uint64_t nanos) {
+        int bucket = nanos == 0 ? 0 : highestBit(nanos) + 1;
+        Shard& shard = shards[metricShard()];
+        shard.counts[min(bucket, BUCKETS - 1)].fetch_add(1, memory_order_relaxed);
+        shard.sumNanos.fetch_add(nanos, memory_order_relaxed);
+    }
+
+    Snapshot snapshot() const {
+        Snapshot snap;
+        for (const auto& shard : shards) {
+            for (int b = 0; b < BUCKETS; b++) snap.counts[b] += shard.counts[b].load(memory_order_relaxed);
+            snap.sumNanos += shard.sumNanos.load(memory_order_relaxed);
+        }
+        for (int b = 0; b < BUCKETS; b++) snap.count += snap.counts[b];
+        return snap;
+    }
+};
+
+// Process-wide counters. Per-room message counts live in each History.
+struct ServerMetrics {
+    Counter connectionsAccepted;
+    Counter connectionsClosed;
+    Counter messagesPosted;
+    Counter broadcastsQueued;       // queue depth = queued - delivered
+    Counter broadcastsDelivered;
+    Counter bytesSent;
+    Counter sendCalls;                  // write syscalls to client sockets
+    Counter sendErrors;
+    LatencyHistogram broadcastFanout;   // one broadcast queued to every recipient
+    LatencyHistogram broadcastLatency;  // push onto the broadcast queue until fanned out
+    LatencyHistogram roomLockWait;      // room membership writers (join, leave)
+    LatencyHistogram roomLockHold;
+};
+
+ServerMetrics metrics;
+
+// A mutex that records how long callers waited for it and how long they
+// held it. Usable with lock_guard like the mutex it wraps.
+class TimedMutex {
+private:
+    mutex mtx;
+    LatencyHistogram& waitTime;
+    LatencyHistogram& holdTime;
+    uint64_t acquiredAt = 0;    // only written by the holder
+
+public:
+    TimedMutex(LatencyHistogram& wait, LatencyHistogram& hold) : waitTime(wait), holdTime(hold) {}
+
+    void lock() {
+        uint64_t start = monotonicNanos();
+        mtx.lock();
+        acquiredAt = monotonicNanos();
+        waitTime.record(acquiredAt - start);
+    }
+
+    void unlock() {
+        uint64_t held = monotonicNanos() - acquiredAt;
+        mtx.unlock();
+        holdTime.record(held);
+    }
+};
+
+// ==========================
+// Object Pool
+// ==========================
+
+// Fixed-size objects carved from slabs that are never given back to the
+// heap. Released objects go to a small per-thread cache and move to a
+// shared depot in batches, so an acquire/release pair normally takes no
+// lock. Objects are reused as they are, not reconstructed.
+template <typename T>
+class ObjectPool {
+private:
+    static const size_t SLAB_SIZE = 256;
+    static const size_t CACHE_SIZE = 64;
+
+    struct Depot {
+        mutex mtx;
+        vector<T*> free;
+        vector<unique_ptr<T[]>> slabs;
+    };
+
+    // Trivially destructible, so it can still be used while the thread
+    // exits; after the flusher ran, closed sends everything to the depot.
+    struct Cache {
+        T* items[CACHE_SIZE * 2];
+        size_t count;
+        bool closed;
+    };
+
+    struct CacheFlusher {
+        ~CacheFlusher() {
+            Cache& c = cache();
+            Depot& d = depot();
+            lock_guard<mutex> lock(d.mtx);
+            d.free.insert(d.free.end(), c.items, c.items + c.count);
+            c.count = 0;
+            c.closed = true;
+        }
+    };
+
+    // Leaked on purpose: thread caches flush into it at exit
+    static Depot& depot() {
+        static Depot* d = new Depot();
+        return *d;
+    }
+
+    static Cache& cache() {
+        thread_local Cache c{};
+        thread_local CacheFlusher flusher;
+        (void)flusher;
+        return c;
+    }
+
+    // Moves up to n objects from the depot into the cache; depot lock held.
+    static void refill(Depot& d, Cache& c, size_t n) {
+        if (d.free.empty()) {
+            d.slabs.emplace_back(new T[SLAB_SIZE]);
+            T* slab = d.slabs.back().get();
+            for (size_t i = 0; i < SLAB_SIZE; i++) d.free.push_back(slab + i);
+        }
+        n = min(n, d.free.size());
+        copy(d.free.end() - n, d.free.end(), c.items + c.count);
+        d.free.resize(d.free.size() - n);
+        c.count += n;
+    }
+
+public:
+    static T* acquire() {
+        Cache& c = cache();
+        if (c.count == 0) {
+            Depot& d = depot();
+            lock_guard<mutex> lock(d.mtx);
+            refill(d, c, c.closed ? 1 : CACHE_SIZE);
+        }
+        return c.items[--c.count];
+    }
+
+    static void release(T* obj) {
+        Cache& c = cache();
+        if (c.closed) {
+            Depot& d = depot();
+            lock_guard<mutex> lock(d.mtx);
+            d.free.push_back(obj);
+            return;
+        }
+
+        c.items[c.count++] = obj;
+        if (c.count == CACHE_SIZE * 2) {
+            Depot& d = depot();
+            lock_guard<mutex> lock(d.mtx);
+            d.free.insert(d.free.end(), c.items + CACHE_SIZE, c.items + c.count);
+            c.count = CACHE_SIZE;
+        }
+    }
+};
+
+// ==========================
+// Interned Names
+// ==========================
+
+// A username or room name stored once in the NameTable. Names are never
+// freed, so a Name is just a pointer and copying one costs nothing.
+class Name {
+private:
+    const string* str;
+
+    static const string& none() {
+        static const string empty;
+        return empty;
+    }
+
+public:
+    Name() : str(&none()) {}
+    explicit Name(const string* s) : str(s) {}
+
+    operator const string&() const { return *str; }
+    const string& get() const { return *str; }
+    size_t size() const { return str->size(); }
+    const char* data() const { return str->data(); }
+};
+
+// Grows with the number of distinct users and rooms ever seen.
+class NameTable {
+private:
+    unordered_set<string> names;
+    mutable shared_mutex mtx;
+
+public:
+    Name intern(const string& name) {
+        {
+            shared_lock<shared_mutex> lock(mtx);
+            auto it = names.find(name);
+            if (it != names.end()) return Name(&*it);
+        }
+        lock_guard<shared_mutex> lock(mtx);
+        return Name(&*names.insert(name).first);
+    }
+};
+
+NameTable nameTable;
+
 // ==========================
 // Message Class
 // ==========================
 
+// Messages are created once from ObjectPool<Message> and shared by
+// MessageRef through history, undo, the log and the broadcast queues. They
+// are not modified after create().
 class Message {
 public:
-    int id;
-    string sender;
+    int id = 0;
+    Name sender;
     string text;
-    time_t timestamp;
-
-    Message(int i = 0, string s = "", string t = "")
-        : id(i), sender(s), text(t) {
-        timestamp = time(nullptr);
-    }
+    Name room;          // room the message was posted to
+    time_t timestamp = 0;
 
     string toString() const {
         return formatMessageWithTime(sender, text);
     }
+
+    void appendTo(string& out) const {
+        appendMessageWithTime(out, sender, text);
+    }
+
+private:
+    friend class MessageRef;
+    atomic<uint32_t> refs{0};
+};
+
+// Intrusive reference to a pooled Message. The last reference returns it
+// to the pool with its text buffer, so a steady stream of messages stops
+// allocating once the pool and buffers have warmed up.
+class MessageRef {
+private:
+    Message* ptr = nullptr;
+
+    explicit MessageRef(Message* m) : ptr(m) {}
+
+public:
+    MessageRef() = default;
+
+    static MessageRef create(int id, Name sender, string_view text, Name room, time_t timestamp = time(nullptr)) {
+        Message* m = ObjectPool<Message>::acquire();
+        m->id = id;
+        m->sender = sender;
+        m->text.assign(text.data(), text.size());   // reuses the recycled capacity
+        m->room = room;
+        m->timestamp = timestamp;
+        m->refs.store(1, memory_order_relaxed);
+        return MessageRef(m);
+    }
+
+    MessageRef(const MessageRef& other) : ptr(other.ptr) {
+        if (ptr) ptr->refs.fetch_add(1, memory_order_relaxed);
+    }
+
+    MessageRef(MessageRef&& other) noexcept : ptr(other.ptr) {
+        other.ptr = nullptr;
+    }
+
+    MessageRef& operator=(MessageRef other) noexcept {
+        swap(ptr, other.ptr);
+        return *this;
+    }
+
+    ~MessageRef() { reset(); }
+
+    void reset() {
+        if (ptr && ptr->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+            // Keep ordinary buffers for reuse, give back unusually large ones
+            if (ptr->text.capacity() > POOLED_TEXT_CAPACITY) string().swap(ptr->text);
+            ObjectPool<Message>::release(ptr);
+        }
+        ptr = nullptr;
+    }
+
+    explicit operator bool() const { return ptr != nullptr; }
+    const Message& operator*() const { return *ptr; }
+    const Message* operator->() const { return ptr; }
 };
 
 // ==========================
 // Message Queue for Broadcasting
 // ==========================
 
+// What a broadcast worker does with a queued message
+enum class BroadcastKind : uint8_t {
+    Post,       // deliver it to the room
+    Retract     // its sender undid it
+};
+
+struct BroadcastEvent {
+    MessageRef message;
+    BroadcastKind kind = BroadcastKind::Post;
+    uint64_t queuedAt = 0;      // monotonicNanos() at push
+};
+
+// Lock-free multi-producer / single-consumer queue (intrusive linked list
+// with a stub node). Any client thread may push; only the broadcast worker
+// pops. The mutex and condition variable are only touched when the consumer
+// is actually asleep.
 class MessageQueue {
 private:
-    queue<Message> messages;
-    mutex mtx;
-    bool shutdown = false;
+    // Nodes come from ObjectPool<Node>, so pushing does not allocate
+    struct Node {
+        atomic<Node*> next{nullptr};
+        BroadcastEvent event;
+    };
+
+    atomic<Node*> head;     // last pushed node, producers swap it
+    Node* tail;             // stub node, owned by the consumer
+    atomic<bool> shutdown{false};
+    atomic<bool> consumerWaiting{false};
+    mutex mtx;              // only for sleeping/waking the consumer
+    condition_variable cv;
+
+    bool hasMessages() const {
+        return tail->next.load() != nullptr;
+    }
+
+public:
+    MessageQueue() {
+        Node* stub = ObjectPool<Node>::acquire();
+        stub->next.store(nullptr);
+        head.store(stub);
+        tail = stub;
+    }
+
+    ~MessageQueue() {
+        while (tail) {
+            Node* next = tail->next.load();
+            tail->event.message.reset();
+            ObjectPool<Node>::release(tail);
+            tail = next;
+        }
+    }
+
+    MessageQueue(const MessageQueue&) = delete;
+    MessageQueue& operator=(const MessageQueue&) = delete;
+
+    void push(BroadcastEvent event) {
+        Node* node = ObjectPool<Node>::acquire();
+        node->next.store(nullptr, memory_order_relaxed);
+        node->event = move(event);
+        node->event.queuedAt = monotonicNanos();
+        metrics.broadcastsQueued.add();
+        Node* prev = head.exchange(node);
+        prev->next.store(node);
+
+        // Pairs with the store of consumerWaiting in waitAndDrain
+        if (consumerWaiting.load()) {
+            lock_guard<mutex> lock(mtx);
+            cv.notify_one();
+        }
+    }
+
+    // Consumer only
+    bool pop(BroadcastEvent& event) {
+        if (shutdown.load()) return false;
+
+        Node* next = tail->next.load(memory_order_acquire);
+        if (next == nullptr) return false;
+
+        event = move(next->event);
+        metrics.broadcastsDelivered.add();
+        ObjectPool<Node>::release(tail);
+        tail = next;    // next becomes the new stub
+        return true;
+    }
+
+    // Blocks until something is queued (or the queue is shut down), then
+    // moves everything queued into batch. Returns false on shutdown.
+    // Consumer only.
+    bool waitAndDrain(vector<BroadcastEvent>& batch) {
+        if (!hasMessages() && !shutdown.load()) {
+            unique_lock<mutex> lock(mtx);
+            consumerWaiting.store(true);
+            cv.wait(lock, [this] { return shutdown.load() || hasMessages(); });
+            consumerWaiting.store(false);
+        }
+
+        BroadcastEvent event;
+        while (pop(event)) {
+            batch.push_back(move(event));
+        }
+        return !shutdown.load();
+    }
+
+    void shutdownQueue() {
+        shutdown.store(true);
+        lock_guard<mutex> lock(mtx);
+        cv.notify_all();
+    }
+};
+
+// ==========================
+// Text Search
+// ==========================
+
+// Word characters for the /search token index: ASCII letters, digits, '_'
+// and any UTF-8 byte, so non-English words stay whole. Spelled out rather
+// than isalnum(), which is a locale-aware call for every byte posted.
+inline bool isWordChar(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+// Calls f(token) for every maximal run of word characters in text.
+template <typename F>
+void forEachToken(string_view text, F f) {
+    size_t i = 0;
+    while (i < text.size()) {
+        while (i < text.size() && !isWordChar((unsigned char)text[i])) i++;
+        size_t start = i;
+        while (i < text.size() && isWordChar((unsigned char)text[i])) i++;
+        if (i > start) f(text.substr(start, i - start));
+    }
+}
+
+inline bool isWordQuery(string_view keyword) {
+    if (keyword.empty()) return false;
+    for (char c : keyword) {
+        if (!isWordChar((unsigned char)c)) return false;
+    }
+    return true;
+}
+
+// Substring search that compares 16 (SSE2) or 32 (AVX2) positions at a time
+// on the needle's first and last byte and only memcmp()s the candidates.
+// Returns nullptr when needle does not occur.
+inline const char* findSubstring(const char* hay, size_t n, const char* needle, size_t m) {
+    if (m == 0) return hay;
+    if (m > n) return nullptr;
+    if (m == 1) return (const char*)memchr(hay, needle[0], n);
+
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i blockFirst = _mm256_loadu_si256((const __m256i*)(hay + i));
+        __m256i blockLast = _mm256_loadu_si256((const __m256i*)(hay + i + m - 1));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst), _mm256_cmpeq_epi8(last, blockLast)));
+        while (mask) {
+            unsigned bit = lowestBit(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i blockFirst = _mm_loadu_si128((const __m128i*)(hay + i));
+        __m128i blockLast = _mm_loadu_si128((const __m128i*)(hay + i + m - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(last, blockLast)));
+        while (mask) {
+            unsigned bit = lowestBit(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    // Tail (or the whole string without SIMD)
+    for (; i + m <= n; i++) {
+        if (hay[i] == needle[0] && hay[i + m - 1] == needle[m - 1] &&
+            memcmp(hay + i + 1, needle + 1, m - 2) == 0) {
+            return hay + i;
+        }
+    }
+    return nullptr;
+}
+
+// ==========================
+// History (Ring Buffer)
+// ==========================
+
+class History {
+private:
+    // Contiguous ring of message slots, oldest at head. Undone messages in
+    // the middle become tombstones; undoing at either end just trims it.
+    // The ring grows up to maxSize as a room gets busy, then its slots are
+    // reused, so adding a message does not allocate after warm-up and quiet
+    // rooms stay small. Slots share the message, they do not copy it.
+    struct Slot {
+        MessageRef message;
+        bool live = false;
+    };
+
+    // Open-addressing id -> slot index so removal is O(1) without per-entry
+    // allocation. Kept at least twice the ring size, linear probing.
+    struct IndexEntry {
+        int id;
+        uint32_t slot;
+    };
+    static const int EMPTY_ID = -1;
+
+    vector<Slot> slots;
+    size_t head;        // oldest occupied slot
+    size_t used;        // occupied slots, tombstones included
+    int size;           // live messages
+    int maxSize;
+    vector<IndexEntry> index;
+    size_t indexMask;
+
+    // Word -> ids of messages containing it. A query made of word characters
+    // can only occur inside a word, so /search scans these distinct words
+    // instead of every message. Undone and evicted ids are left in place,
+    // since finding them in a common word's list costs O(history), and
+    // searchIndexed() skips ids that are no longer live. Once as many
+    // messages have gone as are live, one pass drops the stale ids.
+    unordered_map<string, vector<int>> tokenIndex;
+    size_t staleMessages = 0;   // removed since the last compactTokens()
+
+    mutable shared_mutex mtx;  // mutable for const methods; readers share it
+
+public:
+    Counter posted;             // chat lines posted to this room, for metrics
+
+private:
+    size_t bucketFor(int id) const {
+        return ((uint32_t)id * 2654435761u) & indexMask;
+    }
+
+    size_t slotAt(size_t offset) const {
+        return (head + offset) % slots.size();
+    }
+
+    void indexInsert(int id, uint32_t slot) {
+        size_t i = bucketFor(id);
+        while (index[i].id != EMPTY_ID && index[i].id != id) {
+            i = (i + 1) & indexMask;
+        }
+        index[i] = {id, slot};
+    }
+
+    // Returns the bucket holding id, or index.size() if absent.
+    size_t indexFind(int id) const {
+        size_t i = bucketFor(id);
+        while (index[i].id != EMPTY_ID) {
+            if (index[i].id == id) return i;
+            i = (i + 1) & indexMask;
+        }
+        return index.size();
+    }
+
+    // Backward-shift deletion keeps probe chains intact without tombstones.
+    void indexErase(size_t i) {
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & indexMask;
+            if (index[j].id == EMPTY_ID) break;
+            size_t home = bucketFor(index[j].id);
+            bool movable = (j > i) ? (home <= i || home > j) : (home <= i && home > j);
+            if (movable) {
+                index[i] = index[j];
+                i = j;
+            }
+        }
+        index[i].id = EMPTY_ID;
+    }
+
+    void indexTokens(const Message& msg) {
+        forEachToken(msg.text, [&](string_view token) {
+            vector<int>& ids = tokenIndex[string(token)];
+            if (ids.empty() || ids.back() != msg.id) ids.push_back(msg.id);
+        });
+    }
+
+    // Called once msg is out of the id index
+    void unindexTokens() {
+        if (++staleMessages > max((size_t)size, (size_t)TOKEN_COMPACT_MIN)) compactTokens();
+    }
+
+    // Drops ids that are no longer live, and the copies /redo leaves when
+    // it adds a message back, keeping each list's capacity for reuse.
+    void compactTokens() {
+        for (auto it = tokenIndex.begin(); it != tokenIndex.end();) {
+            vector<int>& ids = it->second;
+            ids.erase(remove_if(ids.begin(), ids.end(), [&](int id) { return indexFind(id) == index.size(); }),
+                      ids.end());
+            sort(ids.begin(), ids.end());
+            ids.erase(unique(ids.begin(), ids.end()), ids.end());
+            it = ids.empty() ? tokenIndex.erase(it) : next(it);
+        }
+        staleMessages = 0;
+    }
+
+    // Query made of word characters: every message holding a word that
+    // contains it, in history order. Same answer as a substring scan.
+    vector<MessageRef> searchIndexed(string_view word) const {
+        // (position in history, slot) of every hit
+        vector<pair<size_t, size_t>> hits;
+        for (const auto& entry : tokenIndex) {
+            const string& token = entry.first;
+            if (!findSubstring(token.data(), token.size(), word.data(), word.size())) continue;
+            for (int id : entry.second) {
+                size_t bucket = indexFind(id);
+                if (bucket == index.size()) continue;
+                size_t slot = index[bucket].slot;
+                hits.push_back({(slot + slots.size() - head) % slots.size(), slot});
+            }
+        }
+        sort(hits.begin(), hits.end());
+        hits.erase(unique(hits.begin(), hits.end()), hits.end());
+
+        vector<MessageRef> result;
+        result.reserve(hits.size());
+        for (const auto& hit : hits) result.push_back(slots[hit.second].message);
+        return result;
+    }
+
+    void rebuildIndex(size_t buckets) {
+        index.assign(buckets, {EMPTY_ID, 0});
+        indexMask = buckets - 1;
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (slots[i].live) indexInsert(slots[i].message->id, (uint32_t)i);
+        }
+    }
+
+    // Adds one slot while the ring is still below maxSize.
+    void grow() {
+        // Unwrap first so the new slot lands after the newest message
+        if (head != 0) {
+            rotate(slots.begin(), slots.begin() + head, slots.end());
+            head = 0;
+            rebuildIndex(index.size());
+        }
+        slots.emplace_back();
+        if (slots.size() * 2 > index.size()) rebuildIndex(index.size() * 2);
+    }
+
+public:
+    History(int maxSize = MAX_MESSAGE_HISTORY)
+        : head(0), used(0), size(0), maxSize(max(1, maxSize)) {
+        rebuildIndex(16);
+    }
+    
+    void addMessage(const MessageRef& ref) {
+        const Message& msg = *ref;
+        lock_guard<shared_mutex> lock(mtx);
+        
+        if (used == slots.size() && slots.size() < (size_t)maxSize) {
+            grow();
+        } else if (used == slots.size()) {
+            // Overwrite the oldest slot once the ring is full
+            Slot& oldest = slots[head];
+            if (oldest.live) {
+                size_t bucket = indexFind(oldest.message->id);
+                if (bucket != index.size()) indexErase(bucket);
+                oldest.live = false;
+                size--;
+                unindexTokens();
+            }
+            head = (head + 1) % slots.size();
+            used--;
+        }
+
+        size_t pos = slotAt(used);
+        slots[pos].message = ref;   // drops the evicted message's reference
+        slots[pos].live = true;
+        indexInsert(msg.id, (uint32_t)pos);
+        indexTokens(msg);
+        used++;
+        size++;
+
+        // An eviction may have exposed tombstones at the front
+        while (!slots[head].live) {
+            head = (head + 1) % slots.size();
+            used--;
+        }
+    }
+    
+    void removeMessage(int messageId) {
+        lock_guard<shared_mutex> lock(mtx);
+        
+        size_t bucket = indexFind(messageId);
+        if (bucket == index.size()) return;
+
+        slots[index[bucket].slot].live = false;
+        indexErase(bucket);
+        size--;
+        unindexTokens();
+
+        // Trim tombstones off both ends so the common undo-last case leaves none
+        while (used > 0 && !slots[slotAt(used - 1)].live) used--;
+        while (used > 0 && !slots[head].live) {
+            head = (head + 1) % slots.size();
+            used--;
+        }
+    }
+    
+    // Calls f(msg) in chronological order for the newest live messages with
+    // afterId < id < beforeId, at most limit of them and about byteBudget
+    // bytes of text. Nothing is copied out. Returns how many were visited
+    // and sets moreOlder if older live messages in that range remain in
+    // memory. Ids are not strictly in ring order (concurrent posts, /redo),
+    // so every slot is checked.
+    template <typename F>
+    size_t visitPage(int afterId, int beforeId, size_t limit, size_t byteBudget, bool& moreOlder, F f) const {
+        shared_lock<shared_mutex> lock(mtx);
+
+        // Newest first, find where the page starts
+        size_t count = 0;
+        size_t bytes = 0;
+        size_t start = used;
+        moreOlder = false;
+        for (size_t i = used; i-- > 0;) {
+            const Slot& slot = slots[slotAt(i)];
+            if (!slot.live || slot.message->id >= beforeId || slot.message->id <= afterId) continue;
+
+            size_t size = slot.message->sender.size() + slot.message->text.size();
+            if (count == limit || (count > 0 && bytes + size > byteBudget)) {
+                moreOlder = true;
+                break;
+            }
+            count++;
+            bytes += size;
+            start = i;
+        }
+
+        size_t visited = 0;
+        for (size_t i = start; i < used && visited < count; i++) {
+            const Slot& slot = slots[slotAt(i)];
+            if (!slot.live || slot.message->id >= beforeId || slot.message->id <= afterId) continue;
+            f(*slot.message);
+            visited++;
+        }
+        return visited;
+    }
+
+    // Id of the oldest message still in memory, INT_MAX if there is none.
+    // Anything older can only come from the persistent log.
+    int oldestId() const {
+        shared_lock<shared_mutex> lock(mtx);
+        return used == 0 ? INT_MAX : slots[head].message->id;
+    }
+
+    vector<MessageRef> getMessages() const {
+        shared_lock<shared_mutex> lock(mtx);
+        vector<MessageRef> result;
+        
+        for (size_t i = 0; i < used; i++) {
+            const Slot& slot = slots[slotAt(i)];
+            if (slot.live) result.push_back(slot.message);
+        }
+        
+        return result;
+    }
+    
+    // Messages containing keyword anywhere. A keyword made only of word
+    // characters is looked up through the token index; anything else is a
+    // substring scan over the room's messages.
+    vector<MessageRef> searchMessages(const string& keyword) const {
+        shared_lock<shared_mutex> lock(mtx);
+        if (isWordQuery(keyword)) return searchIndexed(keyword);
+
+        vector<MessageRef> result;
+        for (size_t i = 0; i < used; i++) {
+            const Slot& slot = slots[slotAt(i)];
+            if (!slot.live) continue;
+            const string& text = slot.message->text;
+            if (findSubstring(text.data(), text.size(), keyword.data(), keyword.size())) {
+                result.push_back(slot.message);
+            }
+        }
+        
+        return result;
+    }
+    
+    void clear() {
+        lock_guard<shared_mutex> lock(mtx);
+        for (auto& slot : slots) {
+            slot.message.reset();
+            slot.live = false;
+        }
+        for (auto& entry : index) entry.id = EMPTY_ID;
+        tokenIndex.clear();
+        staleMessages = 0;
+        head = used = 0;
+        size = 0;
+    }
+};
+
+// ==========================
+// Room Histories
+// ==========================
+
+// One History per room, each behind its own lock, so reading or writing one
+// room never waits on another. The room table is read-mostly: lookups share
+// its lock and only a room's first message takes it exclusively. Histories
+// are never removed, so returned references stay valid.
+class RoomHistories {
+private:
+    unordered_map<string, unique_ptr<History>> histories;
+    mutable shared_mutex mtx;
+
+public:
+    History& room(const string& name) {
+        {
+            shared_lock<shared_mutex> lock(mtx);
+            auto it = histories.find(name);
+            if (it != histories.end()) return *it->second;
+        }
+
+        lock_guard<shared_mutex> lock(mtx);
+        auto& history = histories[name];
+        if (!history) history = make_unique<History>();
+        return *history;
+    }
+
+    // Returns nullptr for a room that never had a message.
+    const History* find(const string& name) const {
+        shared_lock<shared_mutex> lock(mtx);
+        auto it = histories.find(name);
+        return it == histories.end() ? nullptr : it->second.get();
+    }
+
+    template <typename F>
+    void forEach(F f) const {
+        shared_lock<shared_mutex> lock(mtx);
+        for (const auto& entry : histories) f(entry.first, *entry.second);
+    }
+};
+
+// ==========================
+// Message Log (Persistence)
+// ==========================
+
+#ifndef _WIN32
+
+#define LOG_SEGMENT_SIZE (64 * 1024 * 1024)  // bytes before rolling to a new segment
+#define LOG_INDEX_INTERVAL 64                // records per sparse index entry
+#define LOG_GROUP_COMMIT_MS 2                // appends gathered per fsync
+
+// Each room gets a directory under the data dir holding numbered segment
+// files (NNNNNNNNNN.seg), a sparse index per segment (NNNNNNNNNN.idx) and an
+// undo log (undone.log). Segments are append-only. A record is
+//
+//   uint32 size   int32 id   int64 timestamp   uint16 senderLen
+//   char sender[senderLen]   char text[...]    uint32 size
+//
+// in host byte order; the trailing size lets readers walk a segment
+// backwards from its end, so replay and paging only touch the newest pages.
+#define LOG_RECORD_OVERHEAD 22
+
+class RoomLog {
+public:
+    // maxId is the highest id at or before the indexed record, so entries
+    // are monotonic even when ids arrive out of order.
+    struct IndexEntry {
+        int32_t maxId;
+        uint32_t offset;
+    };
+
+private:
+    struct Segment {
+        uint32_t number;
+        int fd;
+        int indexFd;
+        uint64_t size;          // bytes on disk
+        vector<IndexEntry> index;
+    };
+
+    string dir;
+    Name room;
+    vector<Segment> segments;
+    int undoneFd = -1;
+    unordered_set<int> undone;  // ids currently undone
+    int32_t maxId = -1;
+    uint32_t sinceIndex = 0;    // records since the last index entry
+
+    // Filled by appenders, drained by the log writer. The room is dirty
+    // while any of these is non-empty.
+    string pending;
+    vector<pair<int32_t, uint32_t>> pendingRecords;     // (id, size)
+    string pendingUndone;
+    mutable mutex mtx;
+
+    static string segmentPath(const string& dir, uint32_t number, const char* ext) {
+        char name[32];
+        snprintf(name, sizeof(name), "/%010u.%s", number, ext);
+        return dir + name;
+    }
+
+    bool openSegment(uint32_t number) {
+        Segment seg{};
+        seg.number = number;
+        seg.fd = ::open(segmentPath(dir, number, "seg").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        seg.indexFd = ::open(segmentPath(dir, number, "idx").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (seg.fd < 0 || seg.indexFd < 0) return false;
+
+        struct stat st;
+        fstat(seg.fd, &st);
+        seg.size = (uint64_t)st.st_size;
+
+        fstat(seg.indexFd, &st);
+        seg.index.resize((size_t)st.st_size / sizeof(IndexEntry));
+        if (!seg.index.empty()) {
+            ssize_t n = pread(seg.indexFd, seg.index.data(), seg.index.size() * sizeof(IndexEntry), 0);
+            seg.index.resize(n > 0 ? (size_t)n / sizeof(IndexEntry) : 0);
+        }
+        segments.push_back(move(seg));
+        return true;
+    }
+
+    // Checks the record ending at end; returns its start or UINT64_MAX.
+    static uint64_t recordStart(const char* data, uint64_t end) {
+        if (end < LOG_RECORD_OVERHEAD) return UINT64_MAX;
+        uint32_t size;
+        memcpy(&size, data + end - 4, 4);
+        if (size < LOG_RECORD_OVERHEAD || size > end) return UINT64_MAX;
+
+        uint32_t head;
+        memcpy(&head, data + end - size, 4);
+        return head == size ? end - size : UINT64_MAX;
+    }
+
+    static MessageRef decodeRecord(const char* rec, Name room) {
+        uint32_t size;
+        int32_t id;
+        int64_t timestamp;
+        uint16_t senderLen;
+        memcpy(&size, rec, 4);
+        memcpy(&id, rec + 4, 4);
+        memcpy(&timestamp, rec + 8, 8);
+        memcpy(&senderLen, rec + 16, 2);
+
+        const char* sender = rec + 18;
+        const char* text = sender + senderLen;
+        size_t textLen = size - LOG_RECORD_OVERHEAD - senderLen;
+
+        Name senderName = nameTable.intern(string(sender, senderLen));
+        return MessageRef::create(id, senderName, string_view(text, textLen), room, (time_t)timestamp);
+    }
+
+    // Drops a torn write at the end of the newest segment (crash recovery).
+    void repairTail() {
+        Segment& seg = segments.back();
+        if (seg.size == 0) return;
+
+        void* map = mmap(nullptr, seg.size, PROT_READ, MAP_PRIVATE, seg.fd, 0);
+        if (map == MAP_FAILED) return;
+        const char* data = (const char*)map;
+
+        // Walk forward from the last indexed record, which is known good
+        uint64_t pos = seg.index.empty() ? 0 : seg.index.back().offset;
+        while (pos + LOG_RECORD_OVERHEAD <= seg.size) {
+            uint32_t size;
+            memcpy(&size, data + pos, 4);
+            if (size < LOG_RECORD_OVERHEAD || pos + size > seg.size || recordStart(data, pos + size) != pos) break;
+            pos += size;
+        }
+        munmap(map, seg.size);
+
+        if (pos < seg.size) {
+            cerr << "Message log for room '" << room.get() << "': dropping " << (seg.size - pos) << " torn bytes\n";
+            seg.size = pos;
+            while (!seg.index.empty() && seg.index.back().offset >= pos) seg.index.pop_back();
+            if (ftruncate(seg.fd, (off_t)pos) != 0 ||
+                ftruncate(seg.indexFd, (off_t)(seg.index.size() * sizeof(IndexEntry))) != 0) {
+                cerr << "Message log for room '" << room.get() << "': truncate failed: " << errno << endl;
+            }
+        }
+    }
+
+    // Walks records backwards starting at (segment, end offset) and calls
+    // f(message, segment, record offset) newest first until f returns false.
+    // mtx must not be held; only bytes already on disk are read.
+    template <typename F>
+    void walkBackwards(size_t segIdx, uint64_t end, F f) const {
+        while (true) {
+            int fd;
+            {
+                lock_guard<mutex> lock(mtx);
+                fd = segments[segIdx].fd;
+            }
+
+            if (end > 0) {
+                void* map = mmap(nullptr, end, PROT_READ, MAP_SHARED, fd, 0);
+                if (map == MAP_FAILED) return;
+                const char* data = (const char*)map;
+
+                bool more = true;
+                uint64_t pos = end;
+                while (more && pos > 0) {
+                    uint64_t start = recordStart(data, pos);
+                    if (start == UINT64_MAX) break;
+                    more = f(decodeRecord(data + start, room), segIdx, start);
+                    pos = start;
+                }
+                munmap(map, end);
+                if (!more) return;
+            }
+
+            if (segIdx == 0) return;
+            segIdx--;
+            lock_guard<mutex> lock(mtx);
+            end = segments[segIdx].size;
+        }
+    }
+
+public:
+    RoomLog(string dir, const string& room) : dir(move(dir)), room(nameTable.intern(room)) {}
+
+    ~RoomLog() {
+        for (auto& seg : segments) {
+            close(seg.fd);
+            close(seg.indexFd);
+        }
+        if (undoneFd >= 0) close(undoneFd);
+    }
+
+    const string& roomName() const { return room; }
+
+    // Opens (or creates) the room's files. Returns false on I/O errors.
+    bool open() {
+        mkdir(dir.c_str(), 0755);
+
+        vector<uint32_t> numbers;
+        if (DIR* d = opendir(dir.c_str())) {
+            while (dirent* entry = readdir(d)) {
+                unsigned number;
+                char ext[8];
+                if (sscanf(entry->d_name, "%10u.%3s", &number, ext) == 2 && string(ext) == "seg") {
+                    numbers.push_back(number);
+                }
+            }
+            closedir(d);
+        }
+        sort(numbers.begin(), numbers.end());
+        if (numbers.empty()) numbers.push_back(0);
+
+        for (uint32_t number : numbers) {
+            if (!openSegment(number)) return false;
+        }
+        repairTail();
+
+        for (const auto& seg : segments) {
+            if (!seg.index.empty()) maxId = max(maxId, seg.index.back().maxId);
+        }
+
+        undoneFd = ::open((dir + "/undone.log").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (undoneFd < 0) return false;
+
+        // (id, 1 = undone / 0 = redone) pairs, applied in order
+        struct stat st;
+        fstat(undoneFd, &st);
+        vector<int32_t> ops((size_t)st.st_size / 8 * 2);
+        if (!ops.empty()) {
+            ssize_t n = pread(undoneFd, ops.data(), ops.size() * 4, 0);
+            ops.resize(n > 0 ? (size_t)n / 8 * 2 : 0);
+        }
+        for (size_t i = 0; i + 1 < ops.size(); i += 2) {
+            if (ops[i + 1]) undone.insert(ops[i]);
+            else undone.erase(ops[i]);
+        }
+        return true;
+    }
+
+    // Loads the newest live messages into history (memory-mapped, newest
+    // segment backwards) and returns the highest id seen.
+    int32_t replay(History& history, size_t limit) {
+        size_t last;
+        uint64_t end;
+        {
+            lock_guard<mutex> lock(mtx);
+            if (segments.empty()) return maxId;
+            last = segments.size() - 1;
+            end = segments[last].size;
+        }
+
+        vector<MessageRef> newestFirst;
+        // Records after the newest index entry are not covered by its maxId.
+        // Right after a rollover that entry is in an older segment.
+        size_t indexedSeg = last;
+        while (indexedSeg > 0 && segments[indexedSeg].index.empty()) indexedSeg--;
+        uint64_t indexedAt = segments[indexedSeg].index.empty() ? 0 : segments[indexedSeg].index.back().offset;
+        walkBackwards(last, end, [&](MessageRef&& msg, size_t segIdx, uint64_t start) {
+            maxId = max(maxId, (int32_t)msg->id);
+            if (newestFirst.size() < limit && !undone.count(msg->id)) {
+                newestFirst.push_back(move(msg));
+            }
+            bool covered = segIdx < indexedSeg || (segIdx == indexedSeg && start <= indexedAt);
+            return newestFirst.size() < limit || !covered;
+        });
+
+        for (auto it = newestFirst.rbegin(); it != newestFirst.rend(); ++it) {
+            history.addMessage(*it);
+        }
+        return maxId;
+    }
+
+    // Returns true if the room was clean, i.e. the writer must be told.
+    bool append(const Message& msg) {
+        uint16_t senderLen = (uint16_t)min(msg.sender.size(), (size_t)UINT16_MAX);
+        uint32_t size = (uint32_t)(LOG_RECORD_OVERHEAD + senderLen + msg.text.size());
+        int32_t id = msg.id;
+        int64_t timestamp = msg.timestamp;
+
+        lock_guard<mutex> lock(mtx);
+        bool wasClean = pending.empty() && pendingUndone.empty();
+        pending.append((const char*)&size, 4);
+        pending.append((const char*)&id, 4);
+        pending.append((const char*)&timestamp, 8);
+        pending.append((const char*)&senderLen, 2);
+        pending.append(msg.sender.data(), senderLen);
+        pending.append(msg.text);
+        pending.append((const char*)&size, 4);
+        pendingRecords.push_back({id, size});
+        return wasClean;
+    }
+
+    // Same return value as append()
+    bool setUndone(int id, bool isUndone) {
+        int32_t op[2] = {id, isUndone ? 1 : 0};
+        lock_guard<mutex> lock(mtx);
+        bool wasClean = pending.empty() && pendingUndone.empty();
+        pendingUndone.append((const char*)op, sizeof(op));
+        if (isUndone) undone.insert(id);
+        else undone.erase(id);
+        return wasClean;
+    }
+
+    // Writes everything pending and fsyncs once (log writer thread only).
+    void commit() {
+        string data, undoneData;
+        vector<pair<int32_t, uint32_t>> records;
+        {
+            lock_guard<mutex> lock(mtx);
+            data.swap(pending);
+            records.swap(pendingRecords);
+            undoneData.swap(pendingUndone);
+            if (segments.empty()) return;
+        }
+
+        size_t pos = 0;
+        vector<int> dirty;
+        while (pos < data.size()) {
+            Segment* seg;
+            {
+                lock_guard<mutex> lock(mtx);
+                seg = &segments.back();
+                if (seg->size > 0 && seg->size + records.front().second > LOG_SEGMENT_SIZE) {
+                    if (!openSegment(seg->number + 1)) return;
+                    seg = &segments.back();
+                }
+            }
+
+            // Take as many records as fit in this segment
+            size_t chunk = 0;
+            size_t count = 0;
+            vector<IndexEntry> newEntries;
+            uint64_t offset = seg->size;
+            while (count < records.size() && (offset + chunk + records[count].second <= LOG_SEGMENT_SIZE || chunk == 0)) {
+                maxId = max(maxId, records[count].first);
+                if (sinceIndex++ % LOG_INDEX_INTERVAL == 0) {
+                    newEntries.push_back({maxId, (uint32_t)(offset + chunk)});
+                }
+                chunk += records[count].second;
+                count++;
+            }
+
+            if (write(seg->fd, data.data() + pos, chunk) != (ssize_t)chunk ||
+                (!newEntries.empty() &&
+                 write(seg->indexFd, newEntries.data(), newEntries.size() * sizeof(IndexEntry)) < 0)) {
+                cerr << "Message log write failed for room '" << room.get() << "': " << errno << endl;
+                return;
+            }
+            dirty.push_back(seg->fd);
+            dirty.push_back(seg->indexFd);
+
+            {
+                lock_guard<mutex> lock(mtx);
+                seg->size += chunk;
+                seg->index.insert(seg->index.end(), newEntries.begin(), newEntries.end());
+            }
+            records.erase(records.begin(), records.begin() + count);
+            pos += chunk;
+        }
+
+        if (!undoneData.empty() && write(undoneFd, undoneData.data(), undoneData.size()) > 0) {
+            dirty.push_back(undoneFd);
+        }
+
+        sort(dirty.begin(), dirty.end());
+        dirty.erase(unique(dirty.begin(), dirty.end()), dirty.end());
+        for (int fd : dirty) fdatasync(fd);
+    }
+
+    // Up to limit live messages with id < beforeId, oldest first. Jumps to
+    // the right place through the sparse index, so only the pages holding
+    // the requested range are read.
+    vector<MessageRef> readBefore(int beforeId, size_t limit) const {
+        size_t segIdx;
+        uint64_t end;
+        {
+            lock_guard<mutex> lock(mtx);
+            if (segments.empty()) return {};
+            // First index entry whose maxId reaches beforeId: every record
+            // before the entry after it is a candidate.
+            segIdx = segments.size() - 1;
+            end = segments[segIdx].size;
+            for (size_t s = 0; s < segments.size(); s++) {
+                const auto& index = segments[s].index;
+                auto it = lower_bound(index.begin(), index.end(), beforeId,
+                                      [](const IndexEntry& e, int id) { return e.maxId < id; });
+                if (it == index.end()) continue;
+                segIdx = s;
+                ++it;
+                end = it == index.end() ? segments[s].size : it->offset;
+                break;
+            }
+        }
+
+        vector<MessageRef> result;
+        walkBackwards(segIdx, end, [&](MessageRef&& msg, size_t, uint64_t) {
+            bool isUndone;
+            {
+                lock_guard<mutex> lock(mtx);
+                isUndone = undone.count(msg->id) > 0;
+            }
+            if (msg->id < beforeId && !isUndone) result.push_back(move(msg));
+            return result.size() < limit;
+        });
+        reverse(result.begin(), result.end());
+        return result;
+    }
+};
+
+// Owns every room's log and the group-commit writer thread. Appends only
+// buffer in the room's log; the writer is woken when a room turns dirty,
+// gathers for LOG_GROUP_COMMIT_MS, writes each dirty room with one write()
+// and fsyncs it once.
+class MessageLog {
+private:
+    string dataDir;
+    unordered_map<string, unique_ptr<RoomLog>> logs;
+    unordered_set<string> failed;   // rooms whose log could not be opened; not retried
+    unordered_set<RoomLog*> dirty;
+    mutex mtx;
+    condition_variable cv;
+    thread writer;
+    bool running = false;
+
+    static string encodeRoomDir(const string& room) {
+        static const char* hex = "0123456789abcdef";
+        string out;
+        for (unsigned char c : room) {
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+        return out.empty() ? "_" : out;
+    }
+
+    static int hexDigit(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        return -1;
+    }
+
+    // False for names encodeRoomDir never produces (lost+found, stray files)
+    static bool decodeRoomDir(const string& name, string& room) {
+        room.clear();
+        if (name == "_") return true;
+        if (name.empty() || name.size() % 2 != 0) return false;
+        for (size_t i = 0; i < name.size(); i += 2) {
+            int high = hexDigit(name[i]);
+            int low = hexDigit(name[i + 1]);
+            if (high < 0 || low < 0) return false;
+            room += (char)(high << 4 | low);
+        }
+        return true;
+    }
+
+    // mtx must be held. nullptr if the room's files cannot be opened; the
+    // room then lives in memory only and the error is logged once.
+    RoomLog* openRoom(const string& room) {
+        auto it = logs.find(room);
+        if (it != logs.end()) return it->second.get();
+        if (failed.count(room)) return nullptr;
+
+        auto log = make_unique<RoomLog>(dataDir + "/" + encodeRoomDir(room), room);
+        if (!log->open()) {
+            cerr << "Cannot open message log for room '" << room << "': " << strerror(errno) << endl;
+            failed.insert(room);
+            return nullptr;
+        }
+        return (logs[room] = move(log)).get();
+    }
+
+    void markDirty(RoomLog* log) {
+        lock_guard<mutex> lock(mtx);
+        dirty.insert(log);
+        cv.notify_one();
+    }
+
+    void writerLoop() {
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            cv.wait(lock, [this] { return !running || !dirty.empty(); });
+            if (!running && dirty.empty()) return;
+
+            // Let concurrent appends join this commit
+            lock.unlock();
+            this_thread::sleep_for(chrono::milliseconds(LOG_GROUP_COMMIT_MS));
+            lock.lock();
+
+            unordered_set<RoomLog*> batch;
+            batch.swap(dirty);
+            lock.unlock();
+            for (RoomLog* log : batch) log->commit();
+            lock.lock();
+        }
+    }
+
+public:
+    bool enabled() const { return running; }
+
+    // Opens the data dir, replays every room into histories and starts the
+    // writer. Returns the next free message id, or -1 with errno set if the
+    // data dir cannot be created or read.
+    int open(const string& dir, RoomHistories& histories) {
+        dataDir = dir;
+        if (mkdir(dataDir.c_str(), 0755) != 0 && errno != EEXIST) return -1;
+        DIR* d = opendir(dataDir.c_str());
+        if (!d) return -1;
+
+        int32_t maxId = -1;
+        while (dirent* entry = readdir(d)) {
+            string name = entry->d_name;
+            string room;
+            struct stat st;
+            if (!decodeRoomDir(name, room) || stat((dataDir + "/" + name).c_str(), &st) != 0 ||
+                !S_ISDIR(st.st_mode)) {
+                continue;
+            }
+            lock_guard<mutex> lock(mtx);
+            if (RoomLog* log = openRoom(room)) {
+                maxId = max(maxId, log->replay(histories.room(room), MAX_MESSAGE_HISTORY));
+            }
+        }
+        closedir(d);
+
+        running = true;
+        writer = thread(&MessageLog::writerLoop, this);
+        return maxId + 1;
+    }
+
+    // The room's log, or nullptr without --data-dir. Logs live as long as
+    // the MessageLog, so callers may cache the pointer (ClientSession does).
+    RoomLog* roomLog(const string& room) {
+        if (!running) return nullptr;
+        lock_guard<mutex> lock(mtx);
+        return openRoom(room);
+    }
+
+    // Only the post that turns a room dirty takes mtx and wakes the writer
+    void append(RoomLog* log, const Message& msg) {
+        if (log && log->append(msg)) markDirty(log);
+    }
+
+    void setUndone(const Message& msg, bool isUndone) {
+        RoomLog* log = roomLog(msg.room);
+        if (log && log->setUndone(msg.id, isUndone)) markDirty(log);
+    }
+
+    // Whether the room's log holds a live message older than beforeId
+    bool hasBefore(const string& room, int beforeId) {
+        return !readBefore(room, beforeId, 1).empty();
+    }
+
+    vector<MessageRef> readBefore(const string& room, int beforeId, size_t limit) {
+        if (!running) return {};
+        RoomLog* log;
+        {
+            lock_guard<mutex> lock(mtx);
+            auto it = logs.find(room);
+            if (it == logs.end()) return {};
+            log = it->second.get();
+        }
+        return log->readBefore(beforeId, limit);
+    }
+
+    // Flushes what is pending and stops the writer.
+    void close() {
+        {
+            lock_guard<mutex> lock(mtx);
+            if (!running) return;
+            running = false;
+        }
+        cv.notify_one();
+        writer.join();
+    }
+};
+
+#else
+
+// Persistence is POSIX-only (mmap, fdatasync); on Windows history stays in memory.
+class RoomLog;
+
+class MessageLog {
+public:
+    bool enabled() const { return false; }
+    int open(const string&, RoomHistories&) { return 0; }
+    RoomLog* roomLog(const string&) { return nullptr; }
+    void append(RoomLog*, const Message&) {}
+    void setUndone(const Message&, bool) {}
+    bool hasBefore(const string&, int) { return false; }
+    vector<MessageRef> readBefore(const string&, int, size_t) { return {}; }
+    void close() {}
+};
+
+#endif
+
+// ==========================
+// Undo/Redo
+// ==========================
+
+// One per session, so /undo only ever takes back the caller's own
+// messages. Only the session's connection touches it, so it has no lock.
+// Each stack keeps the newest UNDO_DEPTH entries; older ones fall off.
+class UndoRedo {
+private:
+    class BoundedStack {
+    private:
+        MessageRef items[UNDO_DEPTH];
+        size_t top = 0;     // pushes so far; top % UNDO_DEPTH is the next slot
+        size_t count = 0;
+
+    public:
+        void push(MessageRef msg) {
+            items[top % UNDO_DEPTH] = move(msg);   // overwrites the oldest when full
+            top++;
+            count = min(count + 1, (size_t)UNDO_DEPTH);
+        }
+
+        bool pop(MessageRef& msg) {
+            if (count == 0) return false;
+            top--;
+            count--;
+            msg = move(items[top % UNDO_DEPTH]);
+            return true;
+        }
+
+        void clear() {
+            MessageRef dropped;
+            while (pop(dropped)) {}
+        }
+    };
+
+    BoundedStack undoStack;
+    BoundedStack redoStack;
+
+public:
+    void addMessage(const MessageRef& msg) {
+        undoStack.push(msg);
+        redoStack.clear();
+    }
+
+    bool undo(MessageRef& msg) {
+        if (!undoStack.pop(msg)) return false;
+        redoStack.push(msg);
+        return true;
+    }
+
+    bool redo(MessageRef& msg) {
+        if (!redoStack.pop(msg)) return false;
+        undoStack.push(msg);
+        return true;
+    }
+};
+
+// ==========================
+// Admission Control
+// ==========================
+
+// Limits from the command line; 0 switches a limit off
+double userRate = 0;        // messages and commands per second per session
+double userBurst = 0;       // bucket size; 0: one second's worth
+double roomRate = 0;        // chat lines per second per room
+double roomBurst = 0;
+int maxConnections = 0;     // clients connected at once
+int acceptQueueLimit = 0;   // connections left waiting in the listen queue (Linux)
+
+// How often each limit turned something away
+struct AdmissionStats {
+    Counter rejectedFull;       // connections over maxConnections
+    Counter rejectedQueue;      // connections over acceptQueueLimit
+    Counter limitedUser;        // messages over userRate
+    Counter limitedRoom;        // chat lines over roomRate
+};
+
+AdmissionStats admissionStats;
+
+// Allows rate events per second on average and bursts of up to burst
+// (at least one). Starts full. Callers serialize take().
+class TokenBucket {
+private:
+    double tokens = -1;     // -1: never used
+    chrono::steady_clock::time_point last;
+
+public:
+    bool take(double rate, double burst) {
+        auto now = chrono::steady_clock::now();
+        if (burst < 1) burst = max(1.0, rate);
+        if (tokens < 0) {
+            tokens = burst;
+        } else {
+            tokens = min(burst, tokens + rate * chrono::duration<double>(now - last).count());
+        }
+        last = now;
+        if (tokens < 1) return false;
+        tokens -= 1;
+        return true;
+    }
+};
+
+// One bucket per room, sharded by name like the other registries. Rooms
+// are never removed, so neither are their buckets.
+class RoomRateLimits {
+private:
+    struct Bucket {
+        mutex mtx;
+        TokenBucket tokens;
+    };
+    struct Shard {
+        shared_mutex mtx;
+        unordered_map<string, unique_ptr<Bucket>> rooms;
+    };
+    Shard shards[REGISTRY_SHARDS];
+
+public:
+    bool take(const string& room) {
+        Shard& shard = shards[hash<string>{}(room) % REGISTRY_SHARDS];
+        Bucket* bucket = nullptr;
+        {
+            shared_lock<shared_mutex> lock(shard.mtx);
+            auto it = shard.rooms.find(room);
+            if (it != shard.rooms.end()) bucket = it->second.get();
+        }
+        if (!bucket) {
+            lock_guard<shared_mutex> lock(shard.mtx);
+            auto& slot = shard.rooms[room];
+            if (!slot) slot = make_unique<Bucket>();
+            bucket = slot.get();
+        }
+        lock_guard<mutex> lock(bucket->mtx);
+        return bucket->tokens.take(roomRate, roomBurst);
+    }
+};
+
+RoomRateLimits roomRateLimits;
+
+atomic<int> openConnections{0};     // admitted and not yet retired
+
+// Connections the kernel has completed but nobody accepted yet, or -1
+int acceptQueueLength(SOCKET listener) {
+#ifdef __linux__
+    // For a listening socket tcpi_unacked is the accept queue length
+    tcp_info info{};
+    socklen_t len = sizeof(info);
+    if (getsockopt(listener, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) return (int)info.tcpi_unacked;
+#endif
+    return -1;
+}
+
+// Whether a socket just taken from the listener may stay; the caller
+// closes it otherwise, before any thread or buffer is spent on it. While
+// more than acceptQueueLimit clients wait behind it the server is not
+// keeping up, and refusing at once is kinder than letting them time out.
+bool admitConnection(SOCKET listener) {
+    if (acceptQueueLimit > 0 && acceptQueueLength(listener) > acceptQueueLimit) {
+        admissionStats.rejectedQueue.add();
+        return false;
+    }
+    int open = openConnections.fetch_add(1);
+    if (maxConnections > 0 && open >= maxConnections) {
+        openConnections.fetch_sub(1);
+        admissionStats.rejectedFull.add();
+        return false;
+    }
+    return true;
+}
+
+// ==========================
+// Server Data
+// ==========================
+
+RoomHistories roomHistory;
+MessageLog messageLog;
+atomic<int> messageCounter{0};     // next message id; posts come from many threads
+
+enum class ServerEngine { Threads, Epoll, Uring };
+ServerEngine serverEngine = ServerEngine::Threads;
+
+// Per-connection state shared by both engines. The command handlers below
+// only see the session, so they run the same on a dedicated thread or on
+// an epoll reactor.
+struct ClientSession {
+    SOCKET sock = INVALID_SOCKET;
+    string username;
+    string currentRoom = "chatroom";
+    Name senderName;    // interned username and currentRoom for new messages
+    Name roomName;
+    RoomLog* roomLog = nullptr;     // currentRoom's log, looked up at the first post (--data-dir)
+    UndoRedo undoRedo;
+    TokenBucket rateLimit;      // --user-rate; only the session's reader takes from it
+    chrono::steady_clock::time_point lastLimitNotice;
+};
+
+// ==========================
+// Connections
+// ==========================
+
+// Encoded outbound bytes. A broadcast is encoded once and every recipient
+// queues a pointer to the same immutable buffer.
+typedef shared_ptr<const string> SharedBuffer;
+
+SharedBuffer makeBuffer(string data) {
+    return make_shared<const string>(move(data));
+}
+
+// What to do when a client's outbound queue would exceed outboundLimit
+enum class OverflowPolicy {
+    DropOldest,     // discard the oldest queued messages
+    Disconnect,     // drop the client
+    Coalesce        // replace the backlog with one "messages skipped" notice
+};
+
+OverflowPolicy overflowPolicy = OverflowPolicy::Disconnect;
+size_t outboundLimit = DEFAULT_OUTBOUND_LIMIT;
+
+// Broadcast traffic to a client is held for up to flushWindowMicros (or
+// until flushBytes are pending) and then written with one gathered send.
+// Direct replies such as /pm go out at once and take the batch with them.
+enum class Delivery { Immediate, Batched };
+uint64_t flushWindowMicros = 0;     // 0: write every message as it is queued
+size_t flushBytes = DEFAULT_FLUSH_BYTES;
+
+// How often each overflow policy fired
+struct OutboundStats {
+    Counter droppedOldest;      // messages discarded
+    Counter disconnected;       // clients dropped
+    Counter coalesced;          // messages folded into a notice
+};
+
+OutboundStats outboundStats;
+
+// Set from the first byte a client sends (see chat_protocol.h)
+enum class WireProtocol { Unknown, Text, Framed };
+
+struct FlushSchedule;
+struct UringChannel;
+
+// Outbound side of a client. Writes come from any thread (broadcast workers,
+// other clients' commands); they only append to the bounded outq under
+// outMtx and never block on the socket. The epoll engine drains outq from
+// the reactor, the thread engine from a per-client writer thread.
+struct Connection : enable_shared_from_this<Connection> {
+    ClientSession session;
+    int epfd = -1;          // owning reactor, -1 for a thread-per-client socket
+    bool greeted = false;   // username received, session registered
+    atomic<WireProtocol> protocol{WireProtocol::Unknown};
+    FrameDecoder decoder;   // framed clients only, used by the reading thread
+
+    mutex outMtx;
+    condition_variable outCv;   // wakes the writer thread (thread engine)
+    deque<SharedBuffer> outq;
+    size_t outOffset = 0;   // bytes of outq.front() already written
+    size_t outBytes = 0;    // unwritten bytes in outq
+    size_t skipped = 0;     // messages coalesced since the queue last drained
+    size_t writing = 0;     // buffers at the front of outq the writer thread is sending
+    bool urgent = false;    // an Immediate message is queued (thread engine)
+    FlushSchedule* flushSchedule = nullptr;     // owning reactor's batch timer
+    bool flushScheduled = false;
+    UringChannel* uring = nullptr;  // owning io_uring reactor, if any
+    bool sendPending = false;       // io_uring: handed to the reactor or a send is in flight
+    bool pollingOut = false;
+    bool overflowed = false;
+    bool closed = false;    // set before close() so writers never hit a reused fd
+};
+
+// Socket -> connection, sharded by socket
+struct ConnectionShard {
+    mutex mtx;
+    unordered_map<SOCKET, shared_ptr<Connection>> connections;
+};
+ConnectionShard connectionShards[REGISTRY_SHARDS];
+
+ConnectionShard& connectionShardFor(SOCKET sock) {
+    return connectionShards[(size_t)sock % REGISTRY_SHARDS];
+}
+
+void registerConnection(const shared_ptr<Connection>& conn) {
+    ConnectionShard& shard = connectionShardFor(conn->session.sock);
+    lock_guard<mutex> lock(shard.mtx);
+    shard.connections[conn->session.sock] = conn;
+}
+
+void unregisterConnection(SOCKET sock) {
+    ConnectionShard& shard = connectionShardFor(sock);
+    lock_guard<mutex> lock(shard.mtx);
+    shard.connections.erase(sock);
+}
+
+shared_ptr<Connection> findConnection(SOCKET sock) {
+    ConnectionShard& shard = connectionShardFor(sock);
+    lock_guard<mutex> lock(shard.mtx);
+    auto it = shard.connections.find(sock);
+    return it == shard.connections.end() ? nullptr : it->second;
+}
+
+// Username -> connection, split into shards by name so a login or logout
+// only locks its own shard and lookups share the lock. It holds the
+// connection rather than its socket, so nothing meant for a user who has
+// left can reach whoever is given the same socket number next.
+class UserDirectory {
+private:
+    struct Shard {
+        mutable shared_mutex mtx;
+        unordered_map<string, weak_ptr<Connection>> users;
+    };
+    Shard shards[REGISTRY_SHARDS];
+
+    Shard& shardFor(const string& name) {
+        return shards[hash<string>{}(name) % REGISTRY_SHARDS];
+    }
+
+    const Shard& shardFor(const string& name) const {
+        return shards[hash<string>{}(name) % REGISTRY_SHARDS];
+    }
+
+public:
+    void add(const string& name, const shared_ptr<Connection>& conn) {
+        Shard& shard = shardFor(name);
+        lock_guard<shared_mutex> lock(shard.mtx);
+        shard.users[name] = conn;
+    }
+
+    // Only removes name if it still maps to session's connection; a newer login keeps it
+    void remove(const string& name, const ClientSession& session) {
+        Shard& shard = shardFor(name);
+        lock_guard<shared_mutex> lock(shard.mtx);
+        auto it = shard.users.find(name);
+        if (it == shard.users.end()) return;
+        auto conn = it->second.lock();
+        if (!conn || &conn->session == &session) shard.users.erase(it);
+    }
+
+    // nullptr if nobody by that name is connected
+    shared_ptr<Connection> find(const string& name) const {
+        const Shard& shard = shardFor(name);
+        shared_lock<shared_mutex> lock(shard.mtx);
+        auto it = shard.users.find(name);
+        return it == shard.users.end() ? nullptr : it->second.lock();
+    }
+};
+
+UserDirectory userDirectory;
+
+// Unregisters the connection and stops all writes to it; the socket stays
+// open for the caller to close.
+void retireConnection(Connection& conn) {
+    unregisterConnection(conn.session.sock);
+    metrics.connectionsClosed.add();
+    openConnections.fetch_sub(1);
+
+    lock_guard<mutex> lock(conn.outMtx);
+    conn.closed = true;
+    conn.outq.clear();
+    conn.outBytes = 0;
+    conn.outCv.notify_all();
+}
+
+// Unregisters the connection and closes its socket once no writer is using it.
+void closeConnection(const shared_ptr<Connection>& conn) {
+    retireConnection(*conn);
+    closesocket(conn->session.sock);
+}
+
+// Pops what the socket accepted; outMtx must be held.
+void consumeOutbound(Connection& conn, size_t written) {
+    conn.outBytes -= written;
+    while (written > 0) {
+        size_t left = conn.outq.front()->size() - conn.outOffset;
+        if (written < left) {
+            conn.outOffset += written;
+            return;
+        }
+        written -= left;
+        conn.outq.pop_front();
+        conn.outOffset = 0;
+    }
+    if (conn.outq.empty()) conn.skipped = 0;
+}
+
+// Buffers at the front of outq that are partly written or being sent and
+// so must stay queued; outMtx must be held.
+size_t pinnedBuffers(const Connection& conn) {
+    return max(conn.writing, conn.outOffset > 0 ? (size_t)1 : (size_t)0);
+}
+
+// Drops every queued buffer that has not started going out; outMtx must be
+// held. Returns how many messages were dropped.
+size_t discardPending(Connection& conn) {
+    size_t keep = pinnedBuffers(conn);
+    size_t dropped = conn.outq.size() - keep;
+
+    for (size_t i = keep; i < conn.outq.size(); i++) {
+        conn.outBytes -= conn.outq[i]->size();
+    }
+    conn.outq.resize(keep);
+    return dropped;
+}
+
+// Appends to the outbound queue, applying overflowPolicy when the backlog
+// would grow past outboundLimit; outMtx must be held. A single reply larger
+// than the limit (e.g. /history) is still accepted into an empty queue.
+// Returns false if nothing was queued.
+bool enqueueOutbound(Connection& conn, const SharedBuffer& data) {
+    if (conn.overflowed) return false;
+
+    if (conn.outBytes > 0 && conn.outBytes + data->size() > outboundLimit) {
+        switch (overflowPolicy) {
+        case OverflowPolicy::DropOldest: {
+            size_t first = pinnedBuffers(conn);
+            while (conn.outq.size() > first && conn.outBytes + data->size() > outboundLimit) {
+                conn.outBytes -= conn.outq[first]->size();
+                conn.outq.erase(conn.outq.begin() + first);
+                outboundStats.droppedOldest.add();
+            }
+            break;
+        }
+        case OverflowPolicy::Disconnect:
+            conn.overflowed = true;
+            discardPending(conn);
+            outboundStats.disconnected.add();
+            // The reader sees the shutdown and runs the normal disconnect path
+            shutdown(conn.session.sock, SD_BOTH);
+            cerr << "[" << getCurrentTimeString() << "] Disconnecting slow client '" << conn.session.username << "'\n";
+            return false;
+        case OverflowPolicy::Coalesce: {
+            size_t folded = discardPending(conn) + 1;
+            conn.skipped += folded;
+            outboundStats.coalesced.add(folded);
+            // Replaces any earlier notice, which was part of the discarded backlog
+            string notice = "[" + getCurrentTimeString() + "] " + to_string(conn.skipped) +
+                            " message(s) skipped, connection too slow\n";
+            if (conn.protocol == WireProtocol::Framed) {
+                notice = encodeFrame(FrameType::ServerText, "", notice);
+            }
+            conn.outq.push_back(makeBuffer(notice));
+            conn.outBytes += notice.size();
+            return true;
+        }
+        }
+    }
+
+    conn.outq.push_back(data);
+    conn.outBytes += data->size();
+    return true;
+}
+
+// One gathered write of count buffers, the first starting at offset,
+// straight from the shared buffers. Returns the bytes sent or -1.
+template <typename It>
+int64_t sendBuffers(SOCKET sock, It first, size_t count, size_t offset) {
+    metrics.sendCalls.add();
+#ifdef _WIN32
+    WSABUF bufs[MAX_GATHER_BUFFERS];
+    for (size_t i = 0; i < count; i++, ++first) {
+        bufs[i].buf = (char*)(*first)->data() + offset;
+        bufs[i].len = (ULONG)((*first)->size() - offset);
+        offset = 0;
+    }
+    DWORD sent = 0;
+    if (WSASend(sock, bufs, (DWORD)count, &sent, 0, nullptr, nullptr) == SOCKET_ERROR) return -1;
+    return sent;
+#else
+    iovec iov[MAX_GATHER_BUFFERS];
+    for (size_t i = 0; i < count; i++, ++first) {
+        iov[i].iov_base = (void*)((*first)->data() + offset);
+        iov[i].iov_len = (*first)->size() - offset;
+        offset = 0;
+    }
+    msghdr mh{};
+    mh.msg_iov = iov;
+    mh.msg_iovlen = count;
+    return sendmsg(sock, &mh, MSG_NOSIGNAL);
+#endif
+}
+
+#ifdef __linux__
+// Writes queued buffers until the queue is empty or the socket is full;
+// outMtx must be held. Non-blocking, epoll engine only. Returns false when
+// the peer is gone.
+bool flushConnection(Connection& conn) {
+    while (!conn.outq.empty()) {
+        size_t count = min(conn.outq.size(), (size_t)MAX_GATHER_BUFFERS);
+        int64_t n = sendBuffers(conn.session.sock, conn.outq.begin(), count, conn.outOffset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            metrics.sendErrors.add();
+            return false;
+        }
+        metrics.bytesSent.add((uint64_t)n);
+        consumeOutbound(conn, (size_t)n);
+    }
+
+    // Ask the reactor for EPOLLOUT only while something is pending
+    bool wantOut = !conn.outq.empty();
+    if (wantOut != conn.pollingOut) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | (wantOut ? (uint32_t)EPOLLOUT : 0u);
+        ev.data.fd = conn.session.sock;
+        epoll_ctl(conn.epfd, EPOLL_CTL_MOD, conn.session.sock, &ev);
+        conn.pollingOut = wantOut;
+    }
+    return true;
+}
+
+// Writes what is queued now; outMtx must be held. A failed write drops the
+// backlog, and the reactor sees the dead peer on its next read.
+void flushNow(Connection& conn) {
+    if (!flushConnection(conn)) {
+        conn.outq.clear();
+        conn.outBytes = 0;
+        conn.outOffset = 0;
+    }
+}
+
+// Connections of one reactor whose batched output waits for the flush
+// window. The timer is armed by the first one and flushes them all.
+struct FlushSchedule {
+    mutex mtx;
+    vector<shared_ptr<Connection>> due;
+    int timerfd = -1;
+};
+
+// outMtx must be held
+void scheduleFlush(Connection& conn) {
+    FlushSchedule& schedule = *conn.flushSchedule;
+    conn.flushScheduled = true;
+
+    lock_guard<mutex> lock(schedule.mtx);
+    if (schedule.due.empty()) {
+        itimerspec timer{};
+        timer.it_value.tv_sec = (time_t)(flushWindowMicros / 1000000);
+        timer.it_value.tv_nsec = (long)(flushWindowMicros % 1000000) * 1000;
+        timerfd_settime(schedule.timerfd, 0, &timer, nullptr);
+    }
+    schedule.due.push_back(conn.shared_from_this());
+}
+
+// Hands connections with output to their io_uring reactor, which does all
+// of their socket I/O. The reactor drains the list before every submit; a
+// thread other than the reactor also wakes it through the eventfd.
+struct UringChannel {
+    mutex mtx;
+    vector<shared_ptr<Connection>> ready;
+    int wakefd = -1;
+    thread::id owner;
+};
+
+// outMtx must be held and conn.sendPending just set
+void wakeUringSender(Connection& conn) {
+    UringChannel& channel = *conn.uring;
+    bool first;
+    {
+        lock_guard<mutex> lock(channel.mtx);
+        first = channel.ready.empty();
+        channel.ready.push_back(conn.shared_from_this());
+    }
+    if (first && this_thread::get_id() != channel.owner) {
+        uint64_t one = 1;
+        if (write(channel.wakefd, &one, sizeof(one)) < 0) {}
+    }
+}
+#endif
+
+// Writer thread of the thread-per-client engine. Sends without holding
+// outMtx, so a client with a full TCP window only blocks this thread.
+void connectionWriter(shared_ptr<Connection> conn) {
+    vector<SharedBuffer> batch;
+    unique_lock<mutex> lock(conn->outMtx);
+    while (true) {
+        conn->outCv.wait(lock, [&] { return conn->closed || !conn->outq.empty(); });
+        if (flushWindowMicros > 0 && !conn->urgent) {
+            // Let more broadcasts join this write
+            conn->outCv.wait_for(lock, chrono::microseconds(flushWindowMicros), [&] {
+                return conn->closed || conn->urgent || conn->outBytes >= flushBytes;
+            });
+        }
+        if (conn->closed) return;
+        conn->urgent = false;
+        if (conn->outq.empty()) continue;
+
+        // Copies keep the buffers alive while outMtx is released
+        size_t count = min(conn->outq.size(), (size_t)MAX_GATHER_BUFFERS);
+        batch.assign(conn->outq.begin(), conn->outq.begin() + count);
+        size_t offset = conn->outOffset;
+        conn->writing = count;
+        lock.unlock();
+
+        int64_t n = sendBuffers(conn->session.sock, batch.begin(), count, offset);
+        batch.clear();
+
+        lock.lock();
+        conn->writing = 0;
+        if (n <= 0) {
+            // Peer is gone; the reader notices and closes the connection
+            metrics.sendErrors.add();
+            conn->outq.clear();
+            conn->outBytes = 0;
+            conn->outOffset = 0;
+            conn->overflowed = true;
+            return;
+        }
+        metrics.bytesSent.add((uint64_t)n);
+        consumeOutbound(*conn, (size_t)n);
+    }
+}
+
+void queueToConnection(Connection& conn, const SharedBuffer& data, Delivery delivery = Delivery::Immediate) {
+    lock_guard<mutex> lock(conn.outMtx);
+    if (conn.closed) return;
+
+    bool wasIdle = conn.outq.empty();
+    if (!enqueueOutbound(conn, data)) return;
+    bool batch = delivery == Delivery::Batched && flushWindowMicros > 0 && conn.outBytes < flushBytes;
+
+#ifdef __linux__
+    if (conn.uring) {
+        // The reactor sends everything queued once it gets to this connection
+        if (conn.sendPending) return;
+        if (!batch) {
+            conn.sendPending = true;
+            wakeUringSender(conn);
+        } else if (!conn.flushScheduled) {
+            scheduleFlush(conn);
+        }
+        return;
+    }
+    if (conn.epfd >= 0) {
+        // While the socket is full the reactor's EPOLLOUT handler is
+        // already draining in order
+        if (conn.pollingOut) return;
+        if (!batch) {
+            flushNow(conn);
+        } else if (!conn.flushScheduled) {
+            scheduleFlush(conn);
+        }
+        return;
+    }
+#endif
+    if (!batch) conn.urgent = true;
+    if (wasIdle || !batch) conn.outCv.notify_one();
+}
+
+// ==========================
+// Room Membership
+// ==========================
+
+// Each room publishes an immutable list of its members' connections. A
+// broadcast takes the current list with one atomic load, so it never waits
+// for a join or leave; those copy the list under the room's own writer lock
+// and publish the new one (copy-on-write, RCU style). Rooms are spread over
+// shards by name and never removed, so a Room pointer stays valid.
+class RoomRegistry {
+public:
+    typedef vector<shared_ptr<Connection>> Members;
+    typedef shared_ptr<const Members> Snapshot;
+
+private:
+    struct Room {
+        TimedMutex writeMtx{metrics.roomLockWait, metrics.roomLockHold};
+        Snapshot members = make_shared<const Members>();
+    };
+
+    struct Shard {
+        shared_mutex mtx;
+        unordered_map<string, unique_ptr<Room>> rooms;
+    };
+    Shard shards[REGISTRY_SHARDS];
+
+    Shard& shardFor(const string& name) {
+        return shards[hash<string>{}(name) % REGISTRY_SHARDS];
+    }
+
+    Room* find(const string& name) {
+        Shard& shard = shardFor(name);
+        shared_lock<shared_mutex> lock(shard.mtx);
+        auto it = shard.rooms.find(name);
+        return it == shard.rooms.end() ? nullptr : it->second.get();
+    }
+
+    Room& get(const string& name) {
+        if (Room* room = find(name)) return *room;
+        Shard& shard = shardFor(name);
+        lock_guard<shared_mutex> lock(shard.mtx);
+        auto& room = shard.rooms[name];
+        if (!room) room = make_unique<Room>();
+        return *room;
+    }
+
+    template <typename F>
+    static Snapshot update(Room& room, F change) {
+        lock_guard<TimedMutex> lock(room.writeMtx);
+        auto next = make_shared<Members>(*atomic_load(&room.members));
+        change(*next);
+        Snapshot published = move(next);
+        atomic_store(&room.members, published);
+        return published;
+    }
+
+public:
+    // Current members; an empty list for a room nobody joined
+    Snapshot members(const string& name) {
+        Room* room = find(name);
+        return room ? atomic_load(&room->members) : make_shared<const Members>();
+    }
+
+    // Both return the member list right after the change
+    Snapshot join(const string& name, const shared_ptr<Connection>& conn) {
+        return update(get(name), [&](Members& members) {
+            for (const auto& member : members) {
+                if (member == conn) return;
+            }
+            members.push_back(conn);
+        });
+    }
+
+    Snapshot leave(const string& name, SOCKET sock) {
+        Room* room = find(name);
+        if (!room) return make_shared<const Members>();
+        return update(*room, [&](Members& members) {
+            members.erase(remove_if(members.begin(), members.end(),
+                                    [&](const shared_ptr<Connection>& c) { return c->session.sock == sock; }),
+                          members.end());
+        });
+    }
+};
+
+RoomRegistry roomRegistry;
+
+// Text in both wire formats. Each format is encoded at most once, and only
+// if some recipient speaks it; the frame carries the text as its body.
+class OutboundText {
+private:
+    SharedBuffer text;
+    SharedBuffer framed;
+    FrameType frameType = FrameType::ServerText;
+    string frameTarget;
+
+public:
+    explicit OutboundText(SharedBuffer t, FrameType type = FrameType::ServerText, string target = "")
+        : text(move(t)), frameType(type), frameTarget(move(target)) {}
+    OutboundText(SharedBuffer t, SharedBuffer f) : text(move(t)), framed(move(f)) {}
+
+    const SharedBuffer& encodeFor(const Connection& conn) {
+        if (conn.protocol != WireProtocol::Framed) return text;
+        if (!framed) framed = makeBuffer(encodeFrame(frameType, frameTarget, *text));
+        return framed;
+    }
+};
+
+void sendToConnection(Connection& conn, const string& data) {
+    OutboundText out(makeBuffer(data));
+    queueToConnection(conn, out.encodeFor(conn));
+}
+
+void sendToClient(SOCKET sock, const string& data) {
+    if (auto conn = findConnection(sock)) sendToConnection(*conn, data);
+}
+
+void sendToMembers(const RoomRegistry::Snapshot& members, const SharedBuffer& data, SOCKET except = INVALID_SOCKET) {
+    OutboundText out(data);
+    for (const auto& conn : *members) {
+        if (conn->session.sock != except) queueToConnection(*conn, out.encodeFor(*conn), Delivery::Batched);
+    }
+}
+
+// ==========================
+// Broadcast Worker Thread
+// ==========================
+
+// The sender's own echo is the same bytes for a whole second, so each
+// broadcast worker keeps the current one instead of encoding it per message
+const SharedBuffer& senderEcho() {
+    thread_local SharedBuffer echo;
+    string line = "[";
+    Clock::appendTime(line);
+    line += "] \n";
+    if (!echo || *echo != line) echo = makeBuffer(move(line));
+    return echo;
+}
+
+void broadcastMessage(const Message& msg, BroadcastKind kind) {
+    uint64_t start = monotonicNanos();
+
+    // A snapshot of the room: joins and leaves meanwhile do not block this
+    RoomRegistry::Snapshot members = roomRegistry.members(msg.room);
+    if (members->empty())
+        return;
+    shared_ptr<Connection> sender = userDirectory.find(msg.sender);
+
+    // Encoded once per wire format; every recipient shares these buffers.
+    // Framed clients get the message id so they can drop a retracted line.
+    char id[16];
+    snprintf(id, sizeof(id), "%d", msg.id);
+    string line;
+    if (kind == BroadcastKind::Post) {
+        msg.appendTo(line);
+        line += '\n';
+    } else {
+        line = "[";
+        Clock::appendTime(line);
+        line += "] " + msg.sender.get() + " retracted message #" + id + "\n";
+    }
+    OutboundText fullMsg = kind == BroadcastKind::Post
+        ? OutboundText(makeBuffer(move(line)), FrameType::ChatLine, id)
+        : OutboundText(makeBuffer(move(line)), makeBuffer(encodeFrame(FrameType::Retract, msg.room.get(), id)));
+    OutboundText senderTimeMsg(senderEcho());
+
+    for (const auto& conn : *members) {
+        if (conn == sender && kind == BroadcastKind::Post) {
+            // Send to sender with "You" prefix and current time
+            queueToConnection(*conn, senderTimeMsg.encodeFor(*conn), Delivery::Batched);
+        } else {
+            // Send to receivers with original formatted message
+            queueToConnection(*conn, fullMsg.encodeFor(*conn), Delivery::Batched);
+        }
+    }
+    metrics.broadcastFanout.record(monotonicNanos() - start);
+}
+
+void broadcastWorker(MessageQueue* queue) {
+    vector<BroadcastEvent> batch;
+    // Sleeps on the queue until a message arrives; returns on shutdown
+    while (queue->waitAndDrain(batch)) {
+        for (const auto& event : batch) {
+            broadcastMessage(*event.message, event.kind);
+            metrics.broadcastLatency.record(monotonicNanos() - event.queuedAt);
+        }
+        batch.clear();
+    }
+}
+
+// ==========================
+// Broadcast Shards
+// ==========================
+
+// N broadcast workers, each with its own queue. A room always hashes to the
+// same shard, so messages within a room keep their order while busy rooms
+// only slow down the rooms that share their shard.
+class BroadcastPool {
+private:
+    vector<unique_ptr<MessageQueue>> queues;
+    vector<thread> workers;
+
+public:
+    void start(size_t shardCount) {
+        for (size_t i = 0; i < shardCount; i++) {
+            queues.push_back(make_unique<MessageQueue>());
+        }
+        for (auto& queue : queues) {
+            workers.emplace_back(broadcastWorker, queue.get());
+        }
+    }
+
+    size_t size() const { return queues.size(); }
+
+    // A room always maps to the same shard, so a retraction is delivered
+    // after the message it retracts.
+    void push(MessageRef msg, BroadcastKind kind = BroadcastKind::Post) {
+        size_t shard = hash<string>{}(msg->room) % queues.size();
+        queues[shard]->push({move(msg), kind});
+    }
+
+    void shutdown() {
+        for (auto& queue : queues) queue->shutdownQueue();
+        for (auto& worker : workers) {
+            if (worker.joinable()) worker.join();
+        }
+    }
+};
+
+BroadcastPool broadcastPool;
+
+// ==========================
+// History Replies
+// ==========================
+
+// Sends a long reply in HISTORY_CHUNK_SIZE pieces as it is produced, so
+// the full reply is never built in memory.
+class ChunkedReply {
+private:
+    SOCKET sock;
+    string chunk;
+
+public:
+    explicit ChunkedReply(SOCKET s) : sock(s) {}
+
+    ~ChunkedReply() { flush(); }
+
+    void append(const string& text) {
+        chunk += text;
+        if (chunk.size() >= HISTORY_CHUNK_SIZE) flush();
+    }
+
+    void flush() {
+        if (chunk.empty()) return;
+        sendToClient(sock, chunk);
+        chunk.clear();
+    }
+};
+
+string formatHistoryLine(const Message& msg) {
+    string line = "#" + to_string(msg.id) + " ";
+    msg.appendTo(line);
+    line += '\n';
+    return line;
+}
+
+// One page of /history: the newest `limit` messages older than beforeId,
+// oldest first. Pages come from the in-memory window while it reaches;
+// past it they are read from the persistent log.
+void streamHistory(SOCKET clientSock, const string& room, size_t limit, int beforeId) {
+    ChunkedReply reply(clientSock);
+    reply.append("[" + getCurrentTimeString() + "] Message history:\n");
+
+    size_t count = 0;
+    int oldestId = beforeId;
+    bool moreOlder = false;
+
+    const History* history = roomHistory.find(room);
+    if (history) {
+        count = history->visitPage(INT_MIN, beforeId, limit, HISTORY_PAGE_BYTES, moreOlder, [&](const Message& m) {
+            oldestId = min(oldestId, m.id);
+            reply.append(formatHistoryLine(m));
+        });
+    }
+
+    if (count == 0 && messageLog.enabled()) {
+        // At most limit messages, read only from the pages that hold them
+        auto older = messageLog.readBefore(room, beforeId, limit);
+        for (const auto& m : older) reply.append(formatHistoryLine(*m));
+        count = older.size();
+        if (count > 0) oldestId = older.front()->id;
+    }
+
+    // Past the in-memory window, older messages may still be on disk
+    if (count > 0 && !moreOlder) moreOlder = messageLog.hasBefore(room, oldestId);
+
+    if (count == 0) {
+        reply.append("[" + getCurrentTimeString() + "] No " + string(beforeId == INT_MAX ? "" : "older ") +
+                     "message history available.\n");
+    } else if (moreOlder) {
+        reply.append("[" + getCurrentTimeString() + "] Older messages: /history " + to_string(limit) + " " +
+                     to_string(oldestId) + "\n");
+    }
+}
+
+// Replays the room's chat lines with id > sinceId the way they would have
+// arrived live: ChatLine frames with their ids for framed clients, plain
+// lines for text clients, in HISTORY_CHUNK_SIZE pieces of whole lines.
+// Lines come from the in-memory window, one page at most (the newest); a
+// longer gap ends with a pointer to /history, which pages on into the
+// persistent log. The client is already a member, so a line posted
+// meanwhile may come both live and here; framed clients see the same id.
+void streamMissed(Connection& conn, const string& room, int sinceId) {
+    bool framed = conn.protocol == WireProtocol::Framed;
+    string chunk;
+    size_t count = 0;
+    int oldestSent = INT_MAX;
+    bool moreOlder = false;
+
+    const History* history = roomHistory.find(room);
+    if (history) {
+        count = history->visitPage(sinceId, INT_MAX, MAX_MESSAGE_HISTORY, HISTORY_PAGE_BYTES, moreOlder,
+                                   [&](const Message& m) {
+            oldestSent = min(oldestSent, m.id);
+            string line;
+            m.appendTo(line);
+            line += '\n';
+            if (framed) {
+                appendFrame(chunk, FrameType::ChatLine, to_string(m.id), line);
+            } else {
+                chunk += line;
+            }
+            if (chunk.size() >= HISTORY_CHUNK_SIZE) {
+                queueToConnection(conn, makeBuffer(move(chunk)));
+                chunk.clear();
+            }
+        });
+        // Memory does not reach back to sinceId; the rest is on disk
+        moreOlder = moreOlder || (messageLog.enabled() && history->oldestId() > sinceId + 1);
+    }
+    if (!chunk.empty()) queueToConnection(conn, makeBuffer(move(chunk)));
+
+    if (moreOlder) {
+        string next = count > 0 ? " " + to_string(HISTORY_PAGE_SIZE) + " " + to_string(oldestSent) : "";
+        sendToClient(conn.session.sock, "[" + getCurrentTimeString() + "] Earlier missed messages: /history" + next + "\n");
+    }
+}
+
+// ==========================
+// Client Commands
+// ==========================
+
+void onClientConnected(ClientSession& session) {
+    SOCKET clientSock = session.sock;
+    const string& username = session.username;
+    const string& currentRoom = session.currentRoom;
+    session.senderName = nameTable.intern(username);
+    session.roomName = nameTable.intern(currentRoom);
+
+    RoomRegistry::Snapshot members = make_shared<const RoomRegistry::Members>();
+    if (auto conn = findConnection(clientSock)) {
+        userDirectory.add(username, conn);
+        members = roomRegistry.join(currentRoom, conn);
+    }
+
+    string welcome = "[" + getCurrentTimeString() + "] Connected as '" + username + "' to chat server. You are in room: " + currentRoom + "\n";
+    sendToClient(clientSock, welcome);
+
+    // Notify others in the room
+    string joinNotice = "[" + getCurrentTimeString() + "] " + username + " joined the room\n";
+    sendToMembers(members, makeBuffer(joinNotice), clientSock);
+}
+
+// Unregisters the session and tells the room. The caller closes the socket.
+void onClientDisconnected(ClientSession& session) {
+    RoomRegistry::Snapshot others = roomRegistry.leave(session.currentRoom, session.sock);
+    userDirectory.remove(session.username, session);
+    
+    // Notify others about user leaving
+    string leaveNotice = "[" + getCurrentTimeString() + "] " + session.username + " left the room\n";
+    sendToMembers(others, makeBuffer(leaveNotice));
+}
+
+// Tells a client its message went over a rate limit, at most once a
+// second so a flood is not answered with a flood of notices.
+void rejectMessage(ClientSession& session, const string& reason) {
+    auto now = chrono::steady_clock::now();
+    if (now - session.lastLimitNotice < chrono::seconds(1)) return;
+    session.lastLimitNotice = now;
+    sendToClient(session.sock, "[" + getCurrentTimeString() + "] Rate limit: " + reason + ", message dropped.\n");
+}
+
+// --user-rate. Commands count too: /join and /history cost the server more
+// than a line.
+bool admitFromUser(ClientSession& session) {
+    if (userRate <= 0 || session.rateLimit.take(userRate, userBurst)) return true;
+    admissionStats.limitedUser.add();
+    rejectMessage(session, "you are sending too fast");
+    return false;
+}
+
+// --room-rate. Everything that puts a line into a room (plain lines,
+// /reply, /redo) is counted against the room's bucket.
+bool admitToRoom(ClientSession& session, const string& room) {
+    if (roomRate <= 0 || roomRateLimits.take(room)) return true;
+    admissionStats.limitedRoom.add();
+    rejectMessage(session, "room '" + room + "' is busy");
+    return false;
+}
+
+// Stores, logs and broadcasts one chat line from the session to its room.
+void postMessage(ClientSession& session, const string& text) {
+    if (!admitToRoom(session, session.currentRoom)) return;
+    MessageRef msgObj = MessageRef::create(messageCounter++, session.senderName, text, session.roomName);
+    History& history = roomHistory.room(session.currentRoom);
+    history.addMessage(msgObj);
+    history.posted.add();
+    metrics.messagesPosted.add();
+    if (!session.roomLog) session.roomLog = messageLog.roomLog(session.currentRoom);
+    messageLog.append(session.roomLog, *msgObj);
+    session.undoRedo.addMessage(msgObj);
+    broadcastPool.push(move(msgObj));
+}
+
+// Moves the session to room and, unless sinceId is INT_MIN, replays the
+// room's lines after #sinceId. Rejoining the current room (a reconnecting
+// client catching up) changes nothing and tells nobody.
+void joinRoom(ClientSession& session, const string& room, int sinceId) {
+    SOCKET clientSock = session.sock;
+    const string& username = session.username;
+    string& currentRoom = session.currentRoom;
+
+    if (room.empty()) {
+        sendToClient(clientSock, "[" + getCurrentTimeString() + "] Usage: /join <room> [since <id>]\n");
+        return;
+    }
+
+    if (room != currentRoom) {
+        string oldRoom = currentRoom;
+
+        // Each room is locked on its own; other rooms' broadcasts never wait
+        RoomRegistry::Snapshot oldMembers = roomRegistry.leave(oldRoom, clientSock);
+        currentRoom = room;
+        session.roomName = nameTable.intern(room);
+        session.roomLog = nullptr;
+        RoomRegistry::Snapshot newMembers = make_shared<const RoomRegistry::Members>();
+        if (auto conn = findConnection(clientSock)) newMembers = roomRegistry.join(currentRoom, conn);
+
+        // Notify old room about leaving
+        string leaveNotice = "[" + getCurrentTimeString() + "] " + username + " left the room\n";
+        sendToMembers(oldMembers, makeBuffer(leaveNotice));
+
+        // Notify new room about joining
+        string joinNotice = "[" + getCurrentTimeString() + "] " + username + " joined the room\n";
+        sendToMembers(newMembers, makeBuffer(joinNotice), clientSock);
+    }
+
+    string notice = "[" + getCurrentTimeString() + "] You joined room: " + room + "\n";
+    sendToClient(clientSock, notice);
+
+    // Only the lines after the last one the client has seen
+    if (sinceId != INT_MIN) {
+        if (auto conn = findConnection(clientSock)) streamMissed(*conn, room, sinceId);
+    }
+}
+
+void onClientMessage(ClientSession& session, const string& msg) {
+    SOCKET clientSock = session.sock;
+    const string& username = session.username;
+    string& currentRoom = session.currentRoom;
+
+    if (!admitFromUser(session)) return;
+
+    // ================= Commands =================
+    if (msg.rfind("/join", 0) == 0) {
+        // /join <room> [since <id>]
+        string room = msg.size() > 6 ? msg.substr(6) : "";
+        int sinceId = INT_MIN;
+        size_t since = room.rfind(" since ");
+        if (since != string::npos && parseSinceId(string_view(room).substr(since + 7), sinceId)) {
+            room.erase(since);
+        }
+        joinRoom(session, room, sinceId);
+        return;
+    }
+    else if (msg.rfind("/pm", 0) == 0) {
+        if (msg.length() <= 4) {
+            sendToClient(clientSock, "[" + getCurrentTimeString() + "] Usage: /pm <user> <message>\n");
+            return;
+        }
+        string rest = msg.substr(4);
+        string targetName = rest.substr(0, rest.find(" "));
+        string text = rest.substr(rest.find(" ") + 1);
+
+        shared_ptr<Connection> target = userDirectory.find(targetName);
+
+        if (target) {
+            string pmToReceiver = "[" + getCurrentTimeString() + "][PM from " + username + "]: " + text + "\n";
+            string pmToSender = "[" + getCurrentTimeString() + "][PM to " + targetName + "]: " + text + "\n";
+            
+            sendToConnection(*target, pmToReceiver);
+            sendToClient(clientSock, pmToSender);
+        } else {
+            string err = "[" + getCurrentTimeString() + "] User not found.\n";
+            sendToClient(clientSock, err);
+        }
+        return;
+    }
+    else if (msg == "/undo") {
+        MessageRef lastMsg;
+        bool success = session.undoRedo.undo(lastMsg);
+        
+        if (success) {
+            roomHistory.room(lastMsg->room).removeMessage(lastMsg->id);
+            messageLog.setUndone(*lastMsg, true);
+            broadcastPool.push(lastMsg, BroadcastKind::Retract);
+            string notice = "[" + getCurrentTimeString() + "] Last message undone.\n";
+            sendToClient(clientSock, notice);
+        } else {
+            string notice = "[" + getCurrentTimeString() + "] No message to undo.\n";
+            sendToClient(clientSock, notice);
+        }
+        return;
+    }
+    else if (msg == "/help") {
+        string helpText = 
+            "[" + getCurrentTimeString() + "] Available commands:\n"
+            "/join <room> [since n] - Join or create a chat room (and get its messages after #n)\n"
+            "/pm <user> <message>   - Send private message to a user\n"
+            "/reply <user> <msg>    - Reply publicly to a specific user in the room\n"
+            "/undo                  - Undo your last message\n"
+            "/redo                  - Redo your last undone message\n"
+            "/history [n] [id]      - Show the last n messages of this room (older than message #id)\n"
+            "/search <keyword>      - Search for messages containing keyword\n"
+            "/quit                  - Exit the chat application\n"
+            "/help                  - Show this help message\n";
+        sendToClient(clientSock, helpText);
+        return;
+    }
+    else if (msg.rfind("/reply", 0) == 0) {
+        if (msg.length() <= 7) {
+            sendToClient(clientSock, "[" + getCurrentTimeString() + "] Usage: /reply <user> <message>\n");
+            return;
+        }
+        string rest = msg.substr(7);
+        string targetName = rest.substr(0, rest.find(" "));
+        string text = rest.substr(rest.find(" ") + 1);
+    
+        if (userDirectory.find(targetName)) {
+            postMessage(session, "-> " + targetName + ": " + text);
+        } else {
+            string err = "[" + getCurrentTimeString() + "] User '" + targetName + "' not found.\n";
+            sendToClient(clientSock, err);
+        }
+        return;
+    }
+    else if (msg.rfind("/search", 0) == 0) {
+        if (msg.length() <= 8) {
+            string err = "[" + getCurrentTimeString() + "] Usage: /search <keyword>\n";
+            sendToClient(clientSock, err);
+            return;
+        }
+        
+        string keyword = msg.substr(8);
+        // Only the current room's history is searched
+        const History* history = roomHistory.find(currentRoom);
+        auto searchResults = history ? history->searchMessages(keyword) : vector<MessageRef>();
+        
+        if (searchResults.empty()) {
+            string result = "[" + getCurrentTimeString() + "] No messages found containing: '" + keyword + "'\n";
+            sendToClient(clientSock, result);
+        } else {
+            string result = "[" + getCurrentTimeString() + "] Found " + to_string(searchResults.size()) + 
+                           " message(s) containing '" + keyword + "':\n";
+            for (const auto& msg : searchResults) {
+                msg->appendTo(result);
+                result += '\n';
+            }
+            sendToClient(clientSock, result);
+        }
+        return;
+    }
+    else if (msg == "/redo") {
+        MessageRef redoMsg;
+        bool success = session.undoRedo.redo(redoMsg);
+        if (success && !admitToRoom(session, redoMsg->room)) {
+            session.undoRedo.undo(redoMsg);     // stays redoable
+            return;
+        }
+
+        if (success) {
+            roomHistory.room(redoMsg->room).addMessage(redoMsg);
+            messageLog.setUndone(*redoMsg, false);
+            broadcastPool.push(move(redoMsg));
+            string notice = "[" + getCurrentTimeString() + "] Message redone.\n";
+            sendToClient(clientSock, notice);
+        } else {
+            string notice = "[" + getCurrentTimeString() + "] Nothing to redo.\n";
+            sendToClient(clientSock, notice);
+        }
+        return;
+    }
+    else if (msg == "/history" || msg.rfind("/history ", 0) == 0) {
+        // /history [n] [before-id]
+        long limit = HISTORY_PAGE_SIZE;
+        long beforeId = INT_MAX;
+        istringstream args(msg.substr(8));
+        if (!(args >> limit)) limit = HISTORY_PAGE_SIZE;
+        if (!(args >> beforeId)) beforeId = INT_MAX;
+        limit = max(1L, min(limit, (long)MAX_MESSAGE_HISTORY));
+        beforeId = max(0L, min(beforeId, (long)INT_MAX));    // ids start at 0
+
+        streamHistory(clientSock, currentRoom, (size_t)limit, (int)beforeId);
+        return;
+    }
+
+    // ================= Normal Message =================
+    postMessage(session, msg);
+}
+
+// ==========================
+// Client Input
+// ==========================
+
+// Maps a decoded frame onto the same handlers a text client reaches.
+// Returns false on a frame that is not valid at this point.
+bool onClientFrame(Connection& conn, const FrameView& frame) {
+    ClientSession& session = conn.session;
+
+    if (!conn.greeted) {
+        if (frame.type != FrameType::Hello || frame.body.empty()) return false;
+        session.username = string(frame.body);
+        conn.greeted = true;
+        onClientConnected(session);
+        return true;
+    }
+
+    switch (frame.type) {
+    case FrameType::Text:
+        onClientMessage(session, string(frame.body));
+        return true;
+    case FrameType::PrivateMessage:
+        onClientMessage(session, "/pm " + string(frame.target) + " " + string(frame.body));
+        return true;
+    case FrameType::Join: {
+        // The target is the whole room name; a body carries the id of the
+        // last line the client has seen and must be a number
+        int sinceId = INT_MIN;
+        if (!frame.body.empty() && !parseSinceId(frame.body, sinceId)) return false;
+        if (admitFromUser(session)) joinRoom(session, string(frame.target), sinceId);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+bool dispatchFrames(Connection& conn) {
+    FrameView frame;
+    while (conn.decoder.next(frame)) {
+        if (!onClientFrame(conn, frame)) return false;
+    }
+    return !conn.decoder.error();
+}
+
+// Dispatches bytes that one read returned. Text clients keep the original
+// behaviour: the first read is the username and every later read is one
+// message. Returns false on a protocol error.
+bool handleInput(Connection& conn, const char* data, size_t len) {
+    if (conn.protocol == WireProtocol::Unknown) {
+        conn.protocol = data[0] == '\0' ? WireProtocol::Framed : WireProtocol::Text;
+    }
+    if (conn.protocol == WireProtocol::Framed) {
+        conn.decoder.feed(data, len);
+        return dispatchFrames(conn);
+    }
+
+    string text(data, strnlen(data, len));
+    if (!conn.greeted) {
+        conn.session.username = text;
+        conn.greeted = true;
+        onClientConnected(conn.session);
+    } else {
+        onClientMessage(conn.session, text);
+    }
+    return true;
+}
+
+// Reads once from the client and dispatches whatever became complete.
+// Framed clients are read straight into their decoder. Returns recv()'s
+// result, or 0 on a protocol error so callers treat it as a disconnect.
+int readClient(Connection& conn) {
+    if (conn.protocol == WireProtocol::Framed) {
+        size_t space;
+        char* dest = conn.decoder.prepare(4096, space);
+        int valread = (int)recv(conn.session.sock, dest, (int)space, 0);
+        if (valread <= 0) return valread;
+        conn.decoder.commit((size_t)valread);
+        return dispatchFrames(conn) ? valread : 0;
+    }
+
+    char buffer[1024];
+    int valread = (int)recv(conn.session.sock, buffer, sizeof(buffer) - 1, 0);
+    if (valread <= 0) return valread;
+    return handleInput(conn, buffer, (size_t)valread) ? valread : 0;
+}
+
+// ==========================
+// Handle Client (thread-per-client engine)
+// ==========================
+
+void handleClient(SOCKET clientSock) {
+    auto conn = make_shared<Connection>();
+    conn->session.sock = clientSock;
+
+    registerConnection(conn);
+    thread writer(connectionWriter, conn);
+
+    while (readClient(*conn) > 0) {
+    }
+
+    if (conn->greeted) onClientDisconnected(conn->session);
+
+    // Unblocks a writer stuck in send() before its socket goes away
+    shutdown(clientSock, SD_BOTH);
+    {
+        lock_guard<mutex> lock(conn->outMtx);
+        conn->closed = true;
+        conn->outCv.notify_all();
+    }
+    writer.join();
+    closeConnection(conn);
+}
+
+// ==========================
+// Epoll Reactor (Linux)
+// ==========================
+
+#ifdef __linux__
+
+class EpollReactor {
+private:
+    int epfd;
+    FlushSchedule schedule;
+    thread worker;
+
+    // The flush window of the oldest batch ran out: write every batch
+    void flushDue() {
+        uint64_t expirations;
+        if (read(schedule.timerfd, &expirations, sizeof(expirations)) < 0) {}
+
+        vector<shared_ptr<Connection>> due;
+        {
+            lock_guard<mutex> lock(schedule.mtx);
+            due.swap(schedule.due);
+        }
+        for (const auto& conn : due) {
+            lock_guard<mutex> lock(conn->outMtx);
+            conn->flushScheduled = false;
+            if (!conn->closed && !conn->pollingOut) flushNow(*conn);
+        }
+    }
+
+    void dropConnection(const shared_ptr<Connection>& conn) {
+        if (conn->greeted) onClientDisconnected(conn->session);
+
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->session.sock, nullptr);
+        closeConnection(conn);
+    }
+
+    // Drains the socket. Returns false once the peer has disconnected.
+    bool readConnection(const shared_ptr<Connection>& conn) {
+        while (true) {
+            int valread = readClient(*conn);
+            if (valread > 0) {
+                continue;
+            } else if (valread < 0 && errno == EINTR) {
+                continue;
+            } else if (valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return true;
+            } else {
+                return false;
+            }
+        }
+    }
+
+    void run() {
+        epoll_event events[256];
+        while (true) {
+            int n = epoll_wait(epfd, events, 256, -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                cerr << "[" << getCurrentTimeString() << "] epoll_wait failed: " << errno << endl;
+                return;
+            }
+
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.fd == schedule.timerfd) {
+                    flushDue();
+                    continue;
+                }
+                auto conn = findConnection(events[i].data.fd);
+                if (!conn) continue;
+
+                bool alive = true;
+                if (events[i].events & EPOLLOUT) {
+                    lock_guard<mutex> lock(conn->outMtx);
+                    alive = flushConnection(*conn);
+                }
+                if (alive && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                    alive = readConnection(conn);
+                }
+                if (!alive) dropConnection(conn);
+            }
+        }
+    }
 
 public:
-    void push(const Message& msg) {
-        lock_guard<mutex> lock(mtx);
-        messages.push(msg);
+    EpollReactor() {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        schedule.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (epfd >= 0 && schedule.timerfd >= 0) {
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = schedule.timerfd;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, schedule.timerfd, &ev);
+        }
     }
 
-    bool pop(Message& msg) {
-        lock_guard<mutex> lock(mtx);
-        if (messages.empty() || shutdown) return false;
-        
-        msg = messages.front();
-        messages.pop();
-        return true;
+    bool valid() const { return epfd >= 0 && schedule.timerfd >= 0; }
+
+    void start() {
+        worker = thread(&EpollReactor::run, this);
+        worker.detach();
     }
 
-    void shutdownQueue() {
-        lock_guard<mutex> lock(mtx);
-        shutdown = true;
+    // Hands an accepted socket over to this reactor.
+    void adopt(SOCKET sock) {
+        setNonBlocking(sock);
+
+        auto conn = make_shared<Connection>();
+        conn->session.sock = sock;
+        conn->epfd = epfd;
+        conn->flushSchedule = &schedule;
+        registerConnection(conn);
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = sock;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) closeConnection(conn);
     }
 };
 
+#endif
+
 // ==========================
-// History (Linked List based)
+// io_uring Reactor (Linux)
 // ==========================
 
-class History {
+#ifdef HAVE_IO_URING
+
+// Just enough of io_uring over the raw system calls: the submission and
+// completion rings mapped from the kernel, and a provided buffer ring.
+class IoUring {
 private:
-    struct Node {
-        Message message;
-        Node* next;
-        Node* prev;
-        
-        Node(const Message& msg) : message(msg), next(nullptr), prev(nullptr) {}
-    };
-    
-    Node* head;
-    Node* tail;
-    int size;
-    int maxSize;
-    mutable mutex mtx;  // mutable for const methods
+    int ringFd = -1;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t sqesSize = 0;
+
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqArray;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned sqLocalTail = 0;   // entries prepared but not yet published
+    unsigned toSubmit = 0;
+
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    io_uring_cqe* cqes;
 
 public:
-    History(int maxSize = MAX_MESSAGE_HISTORY) : head(nullptr), tail(nullptr), size(0), maxSize(maxSize) {}
-    
-    ~History() {
-        clear();
+    ~IoUring() {
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+        if (ringFd >= 0) close(ringFd);
     }
-    
-    void addMessage(const Message& msg) {
-        lock_guard<mutex> lock(mtx);
-        
-        Node* newNode = new Node(msg);
-        
-        if (head == nullptr) {
-            head = tail = newNode;
-        } else {
-            tail->next = newNode;
-            newNode->prev = tail;
-            tail = newNode;
-        }
-        
-        size++;
-        
-        // Remove oldest message if exceeding max size
-        if (size > maxSize) {
-            Node* temp = head;
-            head = head->next;
-            if (head) head->prev = nullptr;
-            delete temp;
-            size--;
+
+    // False (with errno set) when the kernel has no io_uring or forbids it
+    bool init(unsigned entries) {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = entries * 4;    // multishot operations complete many times
+        ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ringFd < 0 && errno == EINVAL) {
+            params = io_uring_params{};     // kernels before 5.19 lack COOP_TASKRUN
+            ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
         }
+        if (ringFd < 0) return false;
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) return false;
+        cqRing = singleMap ? sqRing
+                           : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) return false;
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+
+        char* sq = (char*)sqRing;
+        sqHead = (unsigned*)(sq + params.sq_off.head);
+        sqTail = (unsigned*)(sq + params.sq_off.tail);
+        sqArray = (unsigned*)(sq + params.sq_off.array);
+        sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        sqLocalTail = *sqTail;
+
+        char* cq = (char*)cqRing;
+        cqHead = (unsigned*)(cq + params.cq_off.head);
+        cqTail = (unsigned*)(cq + params.cq_off.tail);
+        cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+        return true;
     }
-    
-    void removeMessage(int messageId) {
-        lock_guard<mutex> lock(mtx);
-        
-        Node* current = head;
-        while (current != nullptr) {
-            if (current->message.id == messageId) {
-                if (current->prev) current->prev->next = current->next;
-                if (current->next) current->next->prev = current->prev;
-                if (current == head) head = current->next;
-                if (current == tail) tail = current->prev;
-                
-                delete current;
-                size--;
-                return;
-            }
-            current = current->next;
-        }
+
+    int registerOp(unsigned opcode, void* arg, unsigned count) {
+        return (int)syscall(__NR_io_uring_register, ringFd, opcode, arg, count);
     }
-    
-    list<Message> getMessages() const {
-        lock_guard<mutex> lock(mtx);
-        list<Message> result;
-        
-        Node* current = head;
-        while (current != nullptr) {
-            result.push_back(current->message);
-            current = current->next;
+
+    // A zeroed entry for the next operation; submits first if the ring is full
+    io_uring_sqe* prepare() {
+        while (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+            submitAndWait(0);
         }
-        
-        return result;
+        unsigned index = sqLocalTail & sqMask;
+        sqArray[index] = index;
+        sqLocalTail++;
+        toSubmit++;
+        memset(&sqes[index], 0, sizeof(io_uring_sqe));
+        return &sqes[index];
     }
-    
-    list<Message> searchMessages(const string& keyword) const {
-        lock_guard<mutex> lock(mtx);
-        list<Message> result;
-        
-        Node* current = head;
-        while (current != nullptr) {
-            if (current->message.text.find(keyword) != string::npos) {
-                result.push_back(current->message);
-            }
-            current = current->next;
-        }
-        
+
+    // Publishes the prepared entries and waits for waitFor completions
+    int submitAndWait(unsigned waitFor) {
+        __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+        unsigned count = toSubmit;
+        toSubmit = 0;
+        int result;
+        do {
+            result = (int)syscall(__NR_io_uring_enter, ringFd, count, waitFor,
+                                  waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        } while (result < 0 && errno == EINTR);
         return result;
     }
-    
-    void clear() {
-        lock_guard<mutex> lock(mtx);
-        
-        Node* current = head;
-        while (current != nullptr) {
-            Node* next = current->next;
-            delete current;
-            current = next;
+
+    template <typename F>
+    void forEachCompletion(F handle) {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            io_uring_cqe cqe = cqes[head & cqMask];
+            // Released first: the handler may submit and wait again
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            handle(cqe);
         }
-        
-        head = tail = nullptr;
-        size = 0;
     }
 };
 
-// ==========================
-// Undo/Redo
-// ==========================
-
-class UndoRedo {
+// Receive buffers the kernel picks from as data arrives, so an idle client
+// holds no buffer and a multishot recv needs no buffer of its own.
+class RecvBufferRing {
 private:
-    stack<Message> undoStack;
-    stack<Message> redoStack;
-    mutex mtx;
+    io_uring_buf_ring* ring = (io_uring_buf_ring*)MAP_FAILED;
+    size_t ringSize = 0;
+    vector<char> storage;
+    uint16_t tail = 0;
 
 public:
-    void addMessage(const Message& msg) {
-        lock_guard<mutex> lock(mtx);
-        undoStack.push(msg);
-        while (!redoStack.empty()) 
-            redoStack.pop();
+    static const uint16_t GROUP = 0;
+
+    ~RecvBufferRing() {
+        if (ring != MAP_FAILED) munmap(ring, ringSize);
     }
 
-    bool undo(Message& msg) {
-        lock_guard<mutex> lock(mtx);
-        if (undoStack.empty()) return false;
-        msg = undoStack.top();
-        undoStack.pop();
-        redoStack.push(msg);
+    bool init(IoUring& uring) {
+        ringSize = URING_RECV_BUFFERS * sizeof(io_uring_buf);
+        ring = (io_uring_buf_ring*)mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (ring == MAP_FAILED) return false;
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = (uint64_t)ring;
+        reg.ring_entries = URING_RECV_BUFFERS;
+        reg.bgid = GROUP;
+        if (uring.registerOp(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+
+        storage.resize((size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+        for (uint16_t id = 0; id < URING_RECV_BUFFERS; id++) recycle(id);
         return true;
     }
 
-    bool redo(Message& msg) {
-        lock_guard<mutex> lock(mtx);
-        if (redoStack.empty()) return false;
-        msg = redoStack.top();
-        redoStack.pop();
-        undoStack.push(msg);
-        return true;
+    const char* data(uint16_t id) const {
+        return storage.data() + (size_t)id * URING_RECV_BUFFER_SIZE;
+    }
+
+    // Gives a buffer back to the kernel
+    void recycle(uint16_t id) {
+        // Not ring->bufs: in C++ the kernel header's flexible array sits 8
+        // bytes in, so index the ring as plain entries from its start
+        io_uring_buf& buf = ((io_uring_buf*)ring)[tail & (URING_RECV_BUFFERS - 1)];
+        buf.addr = (uint64_t)data(id);
+        buf.len = URING_RECV_BUFFER_SIZE;
+        buf.bid = id;
+        tail++;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
     }
 };
 
-// ==========================
-// Server Data
-// ==========================
+// One thread and one ring per reactor. Every reactor keeps a multishot
+// accept on the shared listening socket, and each of its clients a multishot
+// recv, so reading costs no system call per message. Output from any thread
+// is handed over through the UringChannel; the reactor then gathers each
+// client's queue into one SENDMSG and submits the sends for a whole room
+// fan-out with a single io_uring_enter.
+class UringReactor {
+private:
+    // user_data is a ClientOps pointer with the operation in its low bits,
+    // or one of the tokens below
+    enum : uint64_t { OpRecv = 1, OpSend = 2, OpMask = 7 };
+    enum : uint64_t { AcceptToken = 8, WakeToken = 16, TimerToken = 24 };
 
-map<SOCKET, string> clients;           // socket -> username
-map<string, set<SOCKET>> rooms;        // room -> client sockets
-mutex clientsMtx;
+    // Operations in flight for one client. Lives until none are left.
+    struct ClientOps {
+        shared_ptr<Connection> conn;
+        vector<SharedBuffer> inFlight;  // keeps the buffers of a send alive
+        iovec iov[MAX_GATHER_BUFFERS];
+        msghdr header{};
+        bool recvArmed = false;
+        bool sendInFlight = false;
+        bool dropped = false;
+    };
 
-History roomHistory;
-UndoRedo undoRedo;
-MessageQueue messageQueue;
-int messageCounter = 0;
+    IoUring ring;
+    RecvBufferRing buffers;
+    UringChannel channel;
+    FlushSchedule schedule;
+    SOCKET listener = INVALID_SOCKET;
+    uint64_t wakeValue = 0;
+    uint64_t timerValue = 0;
+    bool multishotAccept = true;    // cleared on kernels that reject it
+    bool multishotRecv = true;
+    unordered_map<Connection*, unique_ptr<ClientOps>> clients;
+    vector<SOCKET> closing;     // closed after the next submit, so no queued entry meets a reused fd
+    size_t sendsQueued = 0;     // send entries since the last submit
+    thread worker;
 
-// ==========================
-// Broadcast Worker Thread
-// ==========================
+    void armAccept() {
+        io_uring_sqe* sqe = ring.prepare();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listener;
+        if (multishotAccept) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = AcceptToken;
+    }
 
-void broadcastWorker() {
-    while (true) {
-        Message msg;
-        if (!messageQueue.pop(msg)) {
-            // Small delay to prevent busy waiting
-            this_thread::sleep_for(chrono::milliseconds(100));
-            continue;
-        }
-        
-        string fullMsg = msg.toString() + "\n";
-        string senderTimeMsg = "[" + getCurrentTimeString() + "] "  + "\n";
-        
-        lock_guard<mutex> lock(clientsMtx);
-        
-        // Find which room the sender is in
-        string targetRoom;
-        for (const auto& room : rooms) {
-            for (const auto& client : room.second) {
-                auto it = clients.find(client);
-                if (it != clients.end() && it->second == msg.sender) {
-                    targetRoom = room.first;
-                    break;
-                }
-            }
-            if (!targetRoom.empty()) break;
-        }
-        
-        if (targetRoom.empty() || rooms.find(targetRoom) == rooms.end()) 
-            continue;
-            
-        for (SOCKET clientSock : rooms[targetRoom]) {
-            auto it = clients.find(clientSock);
-            if (it != clients.end()) {
-                if (it->second == msg.sender) {
-                    // Send to sender with "You" prefix and current time
-                    send(clientSock, senderTimeMsg.c_str(), (int)senderTimeMsg.size(), 0);
-                } else {
-                    // Send to receivers with original formatted message
-                    send(clientSock, fullMsg.c_str(), (int)fullMsg.size(), 0);
-                }
-            }
-        }
+    void armRead(int fd, uint64_t* value, uint64_t token) {
+        io_uring_sqe* sqe = ring.prepare();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)value;
+        sqe->len = sizeof(*value);
+        sqe->user_data = token;
     }
-}
 
-// ==========================
-// Handle Client
-// ==========================
+    void armRecv(ClientOps* ops) {
+        io_uring_sqe* sqe = ring.prepare();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = ops->conn->session.sock;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = RecvBufferRing::GROUP;
+        if (multishotRecv) sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->user_data = (uint64_t)ops | OpRecv;
+        ops->recvArmed = true;
+    }
 
-void handleClient(SOCKET clientSock) {
-    char buffer[1024];
-    string currentRoom = "chatroom";
-    string username;
+    // Sends everything queued (up to MAX_GATHER_BUFFERS) in one SENDMSG;
+    // outMtx must be held and conn->sendPending set.
+    void startSend(ClientOps* ops) {
+        Connection& conn = *ops->conn;
+        if (conn.closed || conn.outq.empty() || ops->dropped) {
+            conn.sendPending = false;
+            return;
+        }
 
-    // Receive username
-    int valread = recv(clientSock, buffer, sizeof(buffer) - 1, 0);
-    if (valread <= 0) {
-        closesocket(clientSock);
-        return;
-    }
-    buffer[valread] = '\0';
-    username = string(buffer);
+        size_t count = min(conn.outq.size(), (size_t)MAX_GATHER_BUFFERS);
+        ops->inFlight.assign(conn.outq.begin(), conn.outq.begin() + count);
+        size_t offset = conn.outOffset;
+        for (size_t i = 0; i < count; i++) {
+            ops->iov[i].iov_base = (void*)(ops->inFlight[i]->data() + offset);
+            ops->iov[i].iov_len = ops->inFlight[i]->size() - offset;
+            offset = 0;
+        }
+        ops->header.msg_iov = ops->iov;
+        ops->header.msg_iovlen = count;
+        conn.writing = count;
 
-    {
-        lock_guard<mutex> lock(clientsMtx);
-        clients[clientSock] = username;
-        rooms[currentRoom].insert(clientSock);
+        io_uring_sqe* sqe = ring.prepare();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn.session.sock;
+        sqe->addr = (uint64_t)&ops->header;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = (uint64_t)ops | OpSend;
+        ops->sendInFlight = true;
+        sendsQueued++;
     }
 
-    string welcome = "[" + getCurrentTimeString() + "] Connected as '" + username + "' to chat server. You are in room: " + currentRoom + "\n";
-    send(clientSock, welcome.c_str(), (int)welcome.size(), 0);
+    ClientOps* findOps(const shared_ptr<Connection>& conn) {
+        auto it = clients.find(conn.get());
+        return it == clients.end() ? nullptr : it->second.get();
+    }
 
-    // Notify others in the room
-    string joinNotice = "[" + getCurrentTimeString() + "] " + username + " joined the room\n";
-    {
-        lock_guard<mutex> lock(clientsMtx);
-        for (SOCKET otherSock : rooms[currentRoom]) {
-            if (otherSock != clientSock) {
-                send(otherSock, joinNotice.c_str(), (int)joinNotice.size(), 0);
-            }
+    // Connections other threads (or this one) queued output for
+    void startReadySends() {
+        vector<shared_ptr<Connection>> ready;
+        {
+            lock_guard<mutex> lock(channel.mtx);
+            ready.swap(channel.ready);
+        }
+        for (const auto& conn : ready) {
+            ClientOps* ops = findOps(conn);
+            lock_guard<mutex> lock(conn->outMtx);
+            if (ops && !ops->sendInFlight) startSend(ops);
         }
     }
 
-    while (true) {
-        valread = recv(clientSock, buffer, sizeof(buffer) - 1, 0);
-        if (valread <= 0) {
-            lock_guard<mutex> lock(clientsMtx);
-            rooms[currentRoom].erase(clientSock);
-            
-            // Notify others about user leaving
-            string leaveNotice = "[" + getCurrentTimeString() + "] " + username + " left the room\n";
-            for (SOCKET otherSock : rooms[currentRoom]) {
-                send(otherSock, leaveNotice.c_str(), (int)leaveNotice.size(), 0);
+    // The flush window of the oldest batch ran out: send every batch
+    void flushDue() {
+        vector<shared_ptr<Connection>> due;
+        {
+            lock_guard<mutex> lock(schedule.mtx);
+            due.swap(schedule.due);
+        }
+        for (const auto& conn : due) {
+            ClientOps* ops = findOps(conn);
+            lock_guard<mutex> lock(conn->outMtx);
+            conn->flushScheduled = false;
+            if (ops && !conn->sendPending) {
+                conn->sendPending = true;
+                startSend(ops);
             }
-            
-            clients.erase(clientSock);
-            closesocket(clientSock);
-            break;
         }
+    }
 
-        buffer[valread] = '\0';
-        string msg(buffer);
+    void adopt(SOCKET sock) {
+        metrics.connectionsAccepted.add();
+        cout << "[" << getCurrentTimeString() << "] New connection accepted.\n";
+        setNoDelay(sock);
 
-        // ================= Commands =================
-        if (msg.rfind("/join", 0) == 0) {
-            string room = msg.substr(6);
-            string oldRoom = currentRoom;
-            
-            {
-                lock_guard<mutex> lock(clientsMtx);
-                rooms[oldRoom].erase(clientSock);
-                
-                // Notify old room about leaving
-                string leaveNotice = "[" + getCurrentTimeString() + "] " + username + " left the room\n";
-                for (SOCKET otherSock : rooms[oldRoom]) {
-                    send(otherSock, leaveNotice.c_str(), (int)leaveNotice.size(), 0);
-                }
-                
-                currentRoom = room;
-                rooms[currentRoom].insert(clientSock);
-                
-                // Notify new room about joining
-                string joinNotice = "[" + getCurrentTimeString() + "] " + username + " joined the room\n";
-                for (SOCKET otherSock : rooms[currentRoom]) {
-                    if (otherSock != clientSock) {
-                        send(otherSock, joinNotice.c_str(), (int)joinNotice.size(), 0);
-                    }
-                }
-            }
-            
-            string notice = "[" + getCurrentTimeString() + "] You joined room: " + room + "\n";
-            send(clientSock, notice.c_str(), (int)notice.size(), 0);
-            continue;
+        auto conn = make_shared<Connection>();
+        conn->session.sock = sock;
+        conn->uring = &channel;
+        conn->flushSchedule = &schedule;
+        registerConnection(conn);
+
+        auto ops = make_unique<ClientOps>();
+        ops->conn = conn;
+        armRecv(ops.get());
+        clients[conn.get()] = move(ops);
+    }
+
+    void drop(ClientOps* ops) {
+        if (!ops->dropped) {
+            ops->dropped = true;
+            if (ops->conn->greeted) onClientDisconnected(ops->conn->session);
+            retireConnection(*ops->conn);
+            // Ends the multishot recv and any send still in flight
+            shutdown(ops->conn->session.sock, SD_BOTH);
         }
-        else if (msg.rfind("/pm", 0) == 0) {
-            string rest = msg.substr(4);
-            string targetName = rest.substr(0, rest.find(" "));
-            string text = rest.substr(rest.find(" ") + 1);
+        if (!ops->recvArmed && !ops->sendInFlight) {
+            closing.push_back(ops->conn->session.sock);
+            clients.erase(ops->conn.get());
+        }
+    }
 
-            SOCKET targetSock = INVALID_SOCKET;
-            {
-                lock_guard<mutex> lock(clientsMtx);
-                for (auto &p : clients) {
-                    if (p.second == targetName) {
-                        targetSock = p.first;
-                        break;
-                    }
-                }
-            }
+    void onRecv(ClientOps* ops, const io_uring_cqe& cqe) {
+        bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+        if (!more) ops->recvArmed = false;
 
-            if (targetSock != INVALID_SOCKET) {
-                string pmToReceiver = "[" + getCurrentTimeString() + "][PM from " + username + "]: " + text + "\n";
-                string pmToSender = "[" + getCurrentTimeString() + "][PM to " + targetName + "]: " + text + "\n";
-                
-                send(targetSock, pmToReceiver.c_str(), (int)pmToReceiver.size(), 0);
-                send(clientSock, pmToSender.c_str(), (int)pmToSender.size(), 0);
-            } else {
-                string err = "[" + getCurrentTimeString() + "] User not found.\n";
-                send(clientSock, err.c_str(), (int)err.size(), 0);
+        if (cqe.res > 0) {
+            uint16_t id = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            bool ok = ops->dropped || handleInput(*ops->conn, buffers.data(id), (size_t)cqe.res);
+            buffers.recycle(id);
+            if (!ok || ops->dropped) {
+                drop(ops);
+            } else if (!more) {
+                armRecv(ops);
             }
-            continue;
+            return;
         }
-        else if (msg == "/undo") {
-            Message lastMsg;
-            bool success = undoRedo.undo(lastMsg);
-            
-            if (success) {
-                roomHistory.removeMessage(lastMsg.id);
-                string notice = "[" + getCurrentTimeString() + "] Last message undone.\n";
-                send(clientSock, notice.c_str(), (int)notice.size(), 0);
-            } else {
-                string notice = "[" + getCurrentTimeString() + "] No message to undo.\n";
-                send(clientSock, notice.c_str(), (int)notice.size(), 0);
-            }
-            continue;
+        if (cqe.res == -EINVAL && multishotRecv && !ops->dropped) {
+            multishotRecv = false;      // before Linux 6.0: one recv at a time
+            armRecv(ops);
+            return;
         }
-        else if (msg == "/help") {
-            string helpText = 
-                "[" + getCurrentTimeString() + "] Available commands:\n"
-                "/join <room>           - Join or create a chat room\n"
-                "/pm <user> <message>   - Send private message to a user\n"
-                "/reply <user> <msg>    - Reply publicly to a specific user in the room\n"
-                "/undo                  - Undo your last message\n"
-                "/redo                  - Redo your last undone message\n"
-                "/history               - Show message history for current room\n"
-                "/search <keyword>      - Search for messages containing keyword\n"
-                "/quit                  - Exit the chat application\n"
-                "/help                  - Show this help message\n";
-            send(clientSock, helpText.c_str(), (int)helpText.size(), 0);
-            continue;
+        if (cqe.res == -ENOBUFS && !ops->dropped) {
+            // Every buffer is in use for a moment; try again
+            if (!more) armRecv(ops);
+            return;
         }
-        else if (msg.rfind("/reply", 0) == 0) {
-            string rest = msg.substr(7);
-            string targetName = rest.substr(0, rest.find(" "));
-            string text = rest.substr(rest.find(" ") + 1);
-        
-            SOCKET targetSock = INVALID_SOCKET;
-            {
-                lock_guard<mutex> lock(clientsMtx);
-                for (auto &p : clients) {
-                    if (p.second == targetName) {
-                        targetSock = p.first;
-                        break;
-                    }
-                }
-            }
-        
-            if (targetSock != INVALID_SOCKET) {
-                Message msgObj(messageCounter++, username, "-> " + targetName + ": " + text);
-                roomHistory.addMessage(msgObj);
-                undoRedo.addMessage(msgObj);
-                messageQueue.push(msgObj);
+        drop(ops);
+    }
+
+    void onSend(ClientOps* ops, const io_uring_cqe& cqe) {
+        ops->sendInFlight = false;
+        Connection& conn = *ops->conn;
+        {
+            lock_guard<mutex> lock(conn.outMtx);
+            conn.writing = 0;
+            if (cqe.res < 0) {
+                metrics.sendErrors.add();
+                conn.sendPending = false;
+                conn.outq.clear();
+                conn.outBytes = 0;
+                conn.outOffset = 0;
+                // The recv then ends and takes the normal disconnect path
+                if (!ops->dropped) shutdown(conn.session.sock, SD_BOTH);
             } else {
-                string err = "[" + getCurrentTimeString() + "] User '" + targetName + "' not found.\n";
-                send(clientSock, err.c_str(), (int)err.size(), 0);
+                metrics.bytesSent.add((uint64_t)cqe.res);
+                if (!conn.closed) consumeOutbound(conn, (size_t)cqe.res);
+                startSend(ops);     // whatever queued up meanwhile
             }
-            continue;
         }
-        else if (msg.rfind("/search", 0) == 0) {
-            if (msg.length() <= 8) {
-                string err = "[" + getCurrentTimeString() + "] Usage: /search <keyword>\n";
-                send(clientSock, err.c_str(), (int)err.size(), 0);
-                continue;
-            }
-            
-            string keyword = msg.substr(8);
-            auto searchResults = roomHistory.searchMessages(keyword);
-            
-            if (searchResults.empty()) {
-                string result = "[" + getCurrentTimeString() + "] No messages found containing: '" + keyword + "'\n";
-                send(clientSock, result.c_str(), (int)result.size(), 0);
+        ops->inFlight.clear();
+        if (ops->dropped) drop(ops);
+    }
+
+    void onAccept(const io_uring_cqe& cqe) {
+        if (cqe.res >= 0) {
+            if (admitConnection(listener)) {
+                adopt(cqe.res);
             } else {
-                string result = "[" + getCurrentTimeString() + "] Found " + to_string(searchResults.size()) + 
-                               " message(s) containing '" + keyword + "':\n";
-                for (const auto& msg : searchResults) {
-                    result += msg.toString() + "\n";
-                }
-                send(clientSock, result.c_str(), (int)result.size(), 0);
+                closesocket(cqe.res);
             }
-            continue;
+        } else if (cqe.res == -EINVAL && multishotAccept) {
+            multishotAccept = false;    // before Linux 5.19
         }
-        else if (msg == "/redo") {
-            Message redoMsg;
-            bool success = undoRedo.redo(redoMsg);
-            
-            if (success) {
-                roomHistory.addMessage(redoMsg);
-                messageQueue.push(redoMsg);
-                string notice = "[" + getCurrentTimeString() + "] Message redone.\n";
-                send(clientSock, notice.c_str(), (int)notice.size(), 0);
-            } else {
-                string notice = "[" + getCurrentTimeString() + "] Nothing to redo.\n";
-                send(clientSock, notice.c_str(), (int)notice.size(), 0);
-            }
-            continue;
+        if (!(cqe.flags & IORING_CQE_F_MORE)) armAccept();
+    }
+
+    void handle(const io_uring_cqe& cqe) {
+        switch (cqe.user_data) {
+        case AcceptToken:
+            onAccept(cqe);
+            return;
+        case WakeToken:
+            armRead(channel.wakefd, &wakeValue, WakeToken);
+            return;
+        case TimerToken:
+            flushDue();
+            armRead(schedule.timerfd, &timerValue, TimerToken);
+            return;
         }
-        else if (msg == "/history") {
-            auto messages = roomHistory.getMessages();
-            string historyText = "[" + getCurrentTimeString() + "] Message history:\n";
-            
-            for (const auto& msg : messages) {
-                historyText += msg.toString() + "\n";
-            }
-            
-            if (messages.empty()) {
-                historyText = "[" + getCurrentTimeString() + "] No message history available.\n";
+        ClientOps* ops = (ClientOps*)(cqe.user_data & ~OpMask);
+        if ((cqe.user_data & OpMask) == OpRecv) {
+            onRecv(ops, cqe);
+        } else {
+            onSend(ops, cqe);
+        }
+    }
+
+    void run() {
+        channel.owner = this_thread::get_id();
+        armAccept();
+        armRead(channel.wakefd, &wakeValue, WakeToken);
+        armRead(schedule.timerfd, &timerValue, TimerToken);
+
+        while (true) {
+            startReadySends();
+            if (sendsQueued > 0) metrics.sendCalls.add();
+            sendsQueued = 0;
+            int result = ring.submitAndWait(1);
+            for (SOCKET sock : closing) closesocket(sock);
+            closing.clear();
+            if (result < 0 && errno != EBUSY) {
+                cerr << "[" << getCurrentTimeString() << "] io_uring_enter failed: " << errno << endl;
+                return;
             }
-            
-            send(clientSock, historyText.c_str(), (int)historyText.size(), 0);
-            continue;
+            ring.forEachCompletion([this](const io_uring_cqe& cqe) { handle(cqe); });
+        }
+    }
+
+public:
+    ~UringReactor() {
+        if (channel.wakefd >= 0) close(channel.wakefd);
+        if (schedule.timerfd >= 0) close(schedule.timerfd);
+    }
+
+    // False (with errno set) when io_uring or provided buffer rings
+    // (Linux 5.19) are not available
+    bool init(SOCKET listenSock) {
+        listener = listenSock;
+        if (!ring.init(URING_ENTRIES) || !buffers.init(ring)) return false;
+        channel.wakefd = eventfd(0, EFD_CLOEXEC);
+        schedule.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        return channel.wakefd >= 0 && schedule.timerfd >= 0;
+    }
+
+    void start() {
+        worker = thread(&UringReactor::run, this);
+    }
+
+    void wait() {
+        if (worker.joinable()) worker.join();
+    }
+};
+
+#endif
+
+// ==========================
+// Metrics Endpoint
+// ==========================
+
+void appendMetric(string& out, const char* name, const char* type, uint64_t value) {
+    out += "# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+    out += name;
+    out += ' ';
+    out += to_string(value);
+    out += '\n';
+}
+
+void appendSummary(string& out, const char* name, const LatencyHistogram& histogram) {
+    LatencyHistogram::Snapshot snap = histogram.snapshot();
+    char line[160];
+    out += "# TYPE " + string(name) + " summary\n";
+    for (double q : {0.5, 0.9, 0.99, 0.999}) {
+        snprintf(line, sizeof(line), "%s{quantile=\"%g\"} %.9f\n", name, q, snap.quantile(q) / 1e9);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "%s_sum %.9f\n%s_count %llu\n", name, snap.sumNanos / 1e9, name,
+             (unsigned long long)snap.count);
+    out += line;
+}
+
+// Prometheus text exposition format
+string renderMetrics() {
+    string out;
+    uint64_t accepted = metrics.connectionsAccepted.value();
+    uint64_t closed = metrics.connectionsClosed.value();
+    uint64_t queued = metrics.broadcastsQueued.value();
+    uint64_t delivered = metrics.broadcastsDelivered.value();
+
+    appendMetric(out, "chat_connections_accepted_total", "counter", accepted);
+    appendMetric(out, "chat_connections_active", "gauge", accepted > closed ? accepted - closed : 0);
+    appendMetric(out, "chat_messages_total", "counter", metrics.messagesPosted.value());
+    appendMetric(out, "chat_broadcast_queue_depth", "gauge", queued > delivered ? queued - delivered : 0);
+    appendMetric(out, "chat_bytes_sent_total", "counter", metrics.bytesSent.value());
+    appendMetric(out, "chat_send_calls_total", "counter", metrics.sendCalls.value());
+    appendMetric(out, "chat_send_errors_total", "counter", metrics.sendErrors.value());
+    appendMetric(out, "chat_outbound_dropped_oldest_total", "counter", outboundStats.droppedOldest.value());
+    appendMetric(out, "chat_outbound_disconnected_total", "counter", outboundStats.disconnected.value());
+    appendMetric(out, "chat_outbound_coalesced_total", "counter", outboundStats.coalesced.value());
+    appendMetric(out, "chat_connections_rejected_full_total", "counter", admissionStats.rejectedFull.value());
+    appendMetric(out, "chat_connections_rejected_queue_total", "counter", admissionStats.rejectedQueue.value());
+    appendMetric(out, "chat_rate_limited_user_total", "counter", admissionStats.limitedUser.value());
+    appendMetric(out, "chat_rate_limited_room_total", "counter", admissionStats.limitedRoom.value());
+    appendSummary(out, "chat_broadcast_fanout_seconds", metrics.broadcastFanout);
+    appendSummary(out, "chat_broadcast_latency_seconds", metrics.broadcastLatency);
+    appendSummary(out, "chat_room_lock_wait_seconds", metrics.roomLockWait);
+    appendSummary(out, "chat_room_lock_hold_seconds", metrics.roomLockHold);
+
+    // Messages per second per room is the rate of this counter
+    out += "# TYPE chat_room_messages_total counter\n";
+    roomHistory.forEach([&](const string& room, const History& history) {
+        string label;
+        for (char c : room) {
+            if (c == '"' || c == '\\') label += '\\';
+            if (c == '\n') { label += "\\n"; continue; }
+            label += c;
         }
+        out += "chat_room_messages_total{room=\"" + label + "\"} " + to_string(history.posted.value()) + "\n";
+    });
+    return out;
+}
+
+// Serves renderMetrics() on 127.0.0.1:port to anything that connects, with
+// a minimal HTTP header so curl and Prometheus can scrape it directly.
+void serveMetrics(SOCKET listener) {
+    while (true) {
+        SOCKET sock = accept(listener, nullptr, nullptr);
+        if (sock == INVALID_SOCKET) continue;
 
-        // ================= Normal Message =================
-        Message msgObj(messageCounter++, username, msg);
-        roomHistory.addMessage(msgObj);
-        undoRedo.addMessage(msgObj);
-        messageQueue.push(msgObj);
+        string response = renderMetrics();
+        response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                   to_string(response.size()) + "\r\nConnection: close\r\n\r\n" + response;
+        send(sock, response.data(), (int)response.size(), 0);
+
+        // Let the peer read everything before the socket goes away
+        shutdown(sock, SD_SEND);
+        char drain[512];
+#ifdef _WIN32
+        DWORD timeout = 1000;
+#else
+        timeval timeout{1, 0};
+#endif
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+        while (recv(sock, drain, sizeof(drain), 0) > 0) {}
+        closesocket(sock);
+    }
+}
+
+bool startMetricsEndpoint(int port) {
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET) return false;
+
+    int opt = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((uint16_t)port);
+    if (::bind(listener, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+        listen(listener, 16) == SOCKET_ERROR) {
+        closesocket(listener);
+        return false;
     }
+
+    thread(serveMetrics, listener).detach();
+    return true;
 }
 
 // ==========================
 // Main
 // ==========================
 
-int main() {
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+// The benchmarks in bench/ include this file for its classes and define
+// CHAT_SERVER_NO_MAIN to leave main() out
+#ifndef CHAT_SERVER_NO_MAIN
+int main(int argc, char* argv[]) {
+    int reactorCount = DEFAULT_REACTOR_THREADS;
+    int broadcastShards = (int)thread::hardware_concurrency();
+    if (broadcastShards <= 0) broadcastShards = 1;
+    string dataDir;     // empty: history is kept in memory only
+    int metricsPort = 0;    // 0: no metrics endpoint
+    int port = PORT;
+    int acceptBacklog = SOMAXCONN;
+#ifdef __linux__
+    serverEngine = ServerEngine::Epoll;
+#endif
+
+    // --engine=threads|epoll|uring   --reactors=N   --broadcast-workers=N
+    // --outbound-limit=BYTES   --overflow=drop-oldest|disconnect|coalesce
+    // --flush-window=MS        batch broadcasts per client for up to MS
+    // --flush-bytes=BYTES      ...or until this much is pending
+    // --data-dir=DIR           persist room history under DIR
+    // --metrics-port=N         serve metrics on 127.0.0.1:N
+    // --port=N                 listen on N instead of PORT
+    // --user-rate=N --user-burst=N     messages per second per client
+    // --room-rate=N --room-burst=N     chat lines per second per room
+    // --max-connections=N      refuse clients beyond N
+    // --accept-backlog=N       listen() backlog
+    // --accept-queue-limit=N   refuse clients while more than N wait to be accepted
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--engine=threads") {
+            serverEngine = ServerEngine::Threads;
+        } else if (arg == "--engine=epoll") {
+#ifdef __linux__
+            serverEngine = ServerEngine::Epoll;
+#else
+            cerr << "epoll engine is only available on Linux, using threads\n";
+#endif
+        } else if (arg == "--engine=uring") {
+#ifdef HAVE_IO_URING
+            serverEngine = ServerEngine::Uring;
+#else
+            cerr << "io_uring engine is not available in this build, using the default engine\n";
+#endif
+        } else if (arg.rfind("--reactors=", 0) == 0) {
+            reactorCount = max(1, atoi(arg.c_str() + 11));
+        } else if (arg.rfind("--broadcast-workers=", 0) == 0) {
+            broadcastShards = max(1, atoi(arg.c_str() + 20));
+        } else if (arg.rfind("--outbound-limit=", 0) == 0) {
+            outboundLimit = (size_t)max(1024L, atol(arg.c_str() + 17));
+        } else if (arg == "--overflow=drop-oldest") {
+            overflowPolicy = OverflowPolicy::DropOldest;
+        } else if (arg == "--overflow=disconnect") {
+            overflowPolicy = OverflowPolicy::Disconnect;
+        } else if (arg == "--overflow=coalesce") {
+            overflowPolicy = OverflowPolicy::Coalesce;
+        } else if (arg.rfind("--flush-window=", 0) == 0) {
+            flushWindowMicros = (uint64_t)max(0.0, atof(arg.c_str() + 15) * 1000);
+        } else if (arg.rfind("--flush-bytes=", 0) == 0) {
+            flushBytes = (size_t)max(1L, atol(arg.c_str() + 14));
+        } else if (arg.rfind("--data-dir=", 0) == 0) {
+            dataDir = arg.substr(11);
+        } else if (arg.rfind("--metrics-port=", 0) == 0) {
+            metricsPort = atoi(arg.c_str() + 15);
+        } else if (arg.rfind("--port=", 0) == 0) {
+            port = atoi(arg.c_str() + 7);
+        } else if (arg.rfind("--user-rate=", 0) == 0) {
+            userRate = max(0.0, atof(arg.c_str() + 12));
+        } else if (arg.rfind("--user-burst=", 0) == 0) {
+            userBurst = max(0.0, atof(arg.c_str() + 13));
+        } else if (arg.rfind("--room-rate=", 0) == 0) {
+            roomRate = max(0.0, atof(arg.c_str() + 12));
+        } else if (arg.rfind("--room-burst=", 0) == 0) {
+            roomBurst = max(0.0, atof(arg.c_str() + 13));
+        } else if (arg.rfind("--max-connections=", 0) == 0) {
+            maxConnections = max(0, atoi(arg.c_str() + 18));
+        } else if (arg.rfind("--accept-backlog=", 0) == 0) {
+            acceptBacklog = max(1, atoi(arg.c_str() + 17));
+        } else if (arg.rfind("--accept-queue-limit=", 0) == 0) {
+            acceptQueueLimit = max(0, atoi(arg.c_str() + 21));
+        } else {
+            cerr << "Usage: " << argv[0] << " [--port=N] [--engine=threads|epoll|uring] [--reactors=N] [--broadcast-workers=N]\n"
+                 << "       [--outbound-limit=BYTES] [--overflow=drop-oldest|disconnect|coalesce]\n"
+                 << "       [--flush-window=MS] [--flush-bytes=BYTES] [--data-dir=DIR] [--metrics-port=N]\n"
+                 << "       [--user-rate=N] [--user-burst=N] [--room-rate=N] [--room-burst=N]\n"
+                 << "       [--max-connections=N] [--accept-backlog=N] [--accept-queue-limit=N]\n";
+            return 1;
+        }
+    }
+
+    if (!socketsInit()) {
         cerr << "WSAStartup failed\n";
         return 1;
     }
 
     SOCKET server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd == INVALID_SOCKET) {
-        cerr << "Socket creation failed: " << WSAGetLastError() << endl;
-        WSACleanup();
+        cerr << "Socket creation failed: " << socketError() << endl;
+        socketsCleanup();
         return 1;
     }
 
@@ -562,45 +3851,121 @@ int main() {
     sockaddr_in address{};
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    address.sin_port = htons((uint16_t)port);
 
-    if (bind(server_fd, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
-        cerr << "Bind failed: " << WSAGetLastError() << endl;
+    if (::bind(server_fd, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+        cerr << "Bind failed: " << socketError() << endl;
         closesocket(server_fd);
-        WSACleanup();
+        socketsCleanup();
         return 1;
     }
 
-    if (listen(server_fd, SOMAXCONN) == SOCKET_ERROR) {
-        cerr << "Listen failed: " << WSAGetLastError() << endl;
+    if (listen(server_fd, acceptBacklog) == SOCKET_ERROR) {
+        cerr << "Listen failed: " << socketError() << endl;
         closesocket(server_fd);
-        WSACleanup();
+        socketsCleanup();
         return 1;
     }
 
-    cout << "[" << getCurrentTimeString() << "] Chat server started on port " << PORT << endl;
+    cout << "[" << getCurrentTimeString() << "] Chat server started on port " << port << endl;
+
+    if (!dataDir.empty()) {
+        auto loadStart = chrono::steady_clock::now();
+        int nextId = messageLog.open(dataDir, roomHistory);
+        if (nextId < 0) {
+            cerr << "Cannot use data dir " << dataDir << ": " << strerror(errno) << endl;
+            closesocket(server_fd);
+            socketsCleanup();
+            return 1;
+        }
+        messageCounter = nextId;
+        auto loadMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - loadStart).count();
+        cout << "[" << getCurrentTimeString() << "] Loaded history from " << dataDir << " in " << loadMs << " ms" << endl;
+    }
+
+    if (metricsPort > 0) {
+        if (startMetricsEndpoint(metricsPort)) {
+            cout << "[" << getCurrentTimeString() << "] Metrics on 127.0.0.1:" << metricsPort << endl;
+        } else {
+            cerr << "Could not open metrics port " << metricsPort << ": " << socketError() << endl;
+        }
+    }
 
-    // Start broadcast worker thread
-    thread broadcastThread(broadcastWorker);
+    // Start broadcast worker threads
+    broadcastPool.start((size_t)broadcastShards);
+    cout << "[" << getCurrentTimeString() << "] " << broadcastShards << " broadcast worker(s)" << endl;
 
-    while (true) {
+#ifdef HAVE_IO_URING
+    vector<unique_ptr<UringReactor>> uringReactors;
+    if (serverEngine == ServerEngine::Uring) {
+        for (int i = 0; i < reactorCount; i++) {
+            uringReactors.push_back(make_unique<UringReactor>());
+            if (!uringReactors.back()->init(server_fd)) {
+                cerr << "[" << getCurrentTimeString() << "] io_uring unavailable (" << strerror(errno) << "), falling back to epoll" << endl;
+                uringReactors.clear();
+                serverEngine = ServerEngine::Epoll;
+                break;
+            }
+        }
+        for (auto& reactor : uringReactors) reactor->start();
+        if (serverEngine == ServerEngine::Uring) {
+            cout << "[" << getCurrentTimeString() << "] Using io_uring engine with " << reactorCount << " reactor thread(s)" << endl;
+        }
+    }
+#endif
+
+#ifdef __linux__
+    vector<unique_ptr<EpollReactor>> reactors;
+    if (serverEngine == ServerEngine::Epoll) {
+        for (int i = 0; i < reactorCount; i++) {
+            reactors.push_back(make_unique<EpollReactor>());
+            if (!reactors.back()->valid()) {
+                cerr << "epoll_create1 failed: " << errno << endl;
+                return 1;
+            }
+            reactors.back()->start();
+        }
+        cout << "[" << getCurrentTimeString() << "] Using epoll engine with " << reactorCount << " reactor thread(s)" << endl;
+    }
+    size_t nextReactor = 0;
+#endif
+
+#ifdef HAVE_IO_URING
+    // The io_uring reactors accept on their own; this thread only waits
+    for (auto& reactor : uringReactors) reactor->wait();
+#endif
+
+    while (serverEngine != ServerEngine::Uring) {
         SOCKET new_socket = accept(server_fd, nullptr, nullptr);
         if (new_socket == INVALID_SOCKET) {
-            cerr << "[" << getCurrentTimeString() << "] Accept failed: " << WSAGetLastError() << endl;
+            cerr << "[" << getCurrentTimeString() << "] Accept failed: " << socketError() << endl;
+            continue;
+        }
+        if (!admitConnection(server_fd)) {
+            closesocket(new_socket);
             continue;
         }
+        metrics.connectionsAccepted.add();
+
+        // Batching is done by the flush window, not by Nagle's algorithm
+        setNoDelay(new_socket);
         cout << "[" << getCurrentTimeString() << "] New connection accepted.\n";
+#ifdef __linux__
+        if (serverEngine == ServerEngine::Epoll) {
+            reactors[nextReactor++ % reactors.size()]->adopt(new_socket);
+            continue;
+        }
+#endif
         thread t(handleClient, new_socket);
         t.detach();
     }
 
     // Cleanup
-    messageQueue.shutdownQueue();
-    if (broadcastThread.joinable()) {
-        broadcastThread.join();
-    }
+    broadcastPool.shutdown();
+    messageLog.close();
     
     closesocket(server_fd);
-    WSACleanup();
+    socketsCleanup();
     return 0;
-}
\ No newline at end of file
+}
+#endif
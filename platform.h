@@ -0,0 +1,99 @@
+// platform.h
+// Thin socket and OS layer shared by the server and the client: Winsock on
+// Windows, POSIX sockets everywhere else. Code above this layer uses the
+// Winsock names (SOCKET, closesocket, SD_BOTH) on every platform.
+#pragma once
+
+#include <ctime>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <cerrno>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#define SD_BOTH SHUT_RDWR
+#define SD_SEND SHUT_WR
+#endif
+
+// ==========================
+// Sockets
+// ==========================
+
+// Call once before any socket is created. Starts Winsock; on POSIX makes a
+// write to a closed peer return EPIPE instead of killing the process.
+inline bool socketsInit() {
+#ifdef _WIN32
+    WSADATA wsaData;
+    return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+#else
+    signal(SIGPIPE, SIG_IGN);
+    return true;
+#endif
+}
+
+inline void socketsCleanup() {
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+// Error code of the last failed socket call
+inline int socketError() {
+#ifdef _WIN32
+    return WSAGetLastError();
+#else
+    return errno;
+#endif
+}
+
+// The call failed only because a non-blocking socket was not ready
+inline bool socketWouldBlock(int error) {
+#ifdef _WIN32
+    return error == WSAEWOULDBLOCK;
+#else
+    return error == EAGAIN || error == EWOULDBLOCK;
+#endif
+}
+
+inline bool setNonBlocking(SOCKET sock, bool enabled = true) {
+#ifdef _WIN32
+    u_long mode = enabled ? 1 : 0;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0) return false;
+    return fcntl(sock, F_SETFL, enabled ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) == 0;
+#endif
+}
+
+inline void setNoDelay(SOCKET sock) {
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+}
+
+// ==========================
+// Time
+// ==========================
+
+// Thread-safe localtime
+inline void localTime(time_t t, tm& out) {
+#ifdef _WIN32
+    localtime_s(&out, &t);
+#else
+    localtime_r(&t, &out);
+#endif
+}
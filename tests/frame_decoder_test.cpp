@@ -0,0 +1,220 @@
+// tests/frame_decoder_test.cpp
+// Randomized test of FrameDecoder: streams of random frames are cut at
+// random split points and fed through both feed() and prepare()/commit(),
+// and must decode to exactly the frames encoded. Malformed headers must put
+// the decoder into its error state and nothing after them may decode.
+//
+//   frame_decoder_test [seed]
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "chat_protocol.h"
+
+using namespace std;
+
+#define ROUNDS 300                // random streams per feeding style
+#define MAX_FRAMES 40             // frames per stream
+#define LARGE_BODY (70 * 1024)    // bodies bigger than any single recv in the server
+
+// Every run uses a new seed unless one is given; failures print it
+#define CHECK(cond, what) \
+    do { \
+        if (!(cond)) { \
+            cerr << "frame_decoder_test: FAILED at line " << __LINE__ << " (seed " << seed << "): " << what << endl; \
+            exit(1); \
+        } \
+    } while (0)
+
+unsigned seed;
+mt19937 rng;
+
+size_t randomSize(size_t max) {
+    return max == 0 ? 0 : rng() % (max + 1);
+}
+
+// ==========================
+// Streams
+// ==========================
+
+struct Frame {
+    FrameType type;
+    string target;
+    string body;
+};
+
+string randomBytes(size_t len) {
+    string out(len, '\0');
+    for (auto& c : out) c = (char)(rng() & 0xff);
+    return out;
+}
+
+vector<Frame> randomFrames() {
+    vector<Frame> frames(1 + randomSize(MAX_FRAMES - 1));
+    for (auto& frame : frames) {
+        frame.type = (FrameType)(1 + rng() % 7);
+        frame.target = randomBytes(rng() % 4 == 0 ? 0 : randomSize(300));
+        size_t bodyLen = rng() % 50 == 0 ? LARGE_BODY + randomSize(1024) : randomSize(200);
+        frame.body = randomBytes(bodyLen);
+    }
+    return frames;
+}
+
+string encodeAll(const vector<Frame>& frames) {
+    string out;
+    for (const auto& frame : frames) appendFrame(out, frame.type, frame.target, frame.body);
+    return out;
+}
+
+// Mostly small pieces, so headers and payloads are split everywhere, with
+// the occasional large one
+size_t randomSplit(size_t left) {
+    size_t size = rng() % 8 == 0 ? 1 + randomSize(100000) : 1 + randomSize(16);
+    return min(size, left);
+}
+
+// Pops every complete frame, copying it out before the views go stale
+void drain(FrameDecoder& decoder, vector<Frame>& out) {
+    FrameView view;
+    while (decoder.next(view)) {
+        out.push_back({view.type, string(view.target), string(view.body)});
+    }
+}
+
+// Feeds stream in random pieces, through feed() or through prepare() and
+// commit() the way the server's reactors receive
+vector<Frame> decodeInPieces(const string& stream, bool usePrepare, FrameDecoder& decoder) {
+    vector<Frame> decoded;
+    size_t pos = 0;
+    while (pos < stream.size()) {
+        size_t piece = randomSplit(stream.size() - pos);
+        if (usePrepare) {
+            size_t space;
+            char* dest = decoder.prepare(1 + randomSize(8192), space);
+            piece = min(piece, space);
+            memcpy(dest, stream.data() + pos, piece);
+            decoder.commit(piece);
+        } else {
+            decoder.feed(stream.data() + pos, piece);
+        }
+        pos += piece;
+        drain(decoder, decoded);
+    }
+    return decoded;
+}
+
+void checkSame(const vector<Frame>& want, const vector<Frame>& got, const char* how) {
+    CHECK(got.size() == want.size(), how << ": decoded " << got.size() << " frames, encoded " << want.size());
+    for (size_t i = 0; i < want.size(); i++) {
+        CHECK(got[i].type == want[i].type && got[i].target == want[i].target && got[i].body == want[i].body,
+              how << ": frame " << i << " differs");
+    }
+}
+
+// ==========================
+// Tests
+// ==========================
+
+void testRoundTrips() {
+    for (int round = 0; round < ROUNDS; round++) {
+        vector<Frame> frames = randomFrames();
+        string stream = encodeAll(frames);
+        for (bool usePrepare : {false, true}) {
+            FrameDecoder decoder;
+            checkSame(frames, decodeInPieces(stream, usePrepare, decoder), usePrepare ? "prepare/commit" : "feed");
+            CHECK(!decoder.error(), "error on a valid stream");
+        }
+    }
+}
+
+void testLimits() {
+    // Empty frames and the largest allowed one
+    vector<Frame> frames = {{FrameType::Text, "", ""},
+                            {FrameType::Join, "room", ""},
+                            {FrameType::ServerText, "", string(MAX_FRAME_SIZE, 'x')}};
+    FrameDecoder decoder;
+    checkSame(frames, decodeInPieces(encodeAll(frames), true, decoder), "limits");
+    CHECK(!decoder.error(), "error on a frame of MAX_FRAME_SIZE");
+}
+
+// A header with byte `at` replaced; must be rejected once complete
+string corruptHeader(size_t at, unsigned char value) {
+    string frame = encodeFrame(FrameType::Text, "ab", "body");
+    frame[at] = (char)value;
+    return frame;
+}
+
+void testMalformed() {
+    string tooLong = corruptHeader(0, 0);
+    uint32_t length = MAX_FRAME_SIZE + 1;
+    for (int i = 0; i < 4; i++) tooLong[i] = (char)(length >> (24 - 8 * i));
+
+    string targetTooLong = encodeFrame(FrameType::Text, "", "body");
+    targetTooLong[6] = 0;
+    targetTooLong[7] = 5;       // targetLen 5 > length 4
+
+    vector<pair<string, const char*>> cases = {
+        {tooLong, "length > MAX_FRAME_SIZE"},
+        {targetTooLong, "targetLen > length"},
+        {corruptHeader(5, 1), "nonzero flags"},
+        {corruptHeader(5, 0x80), "nonzero flags"},
+    };
+
+    for (const auto& c : cases) {
+        for (int round = 0; round < ROUNDS / 10; round++) {
+            // Valid frames, the bad header, then more valid frames
+            vector<Frame> before = randomFrames();
+            string stream = encodeAll(before) + c.first + encodeAll(randomFrames());
+
+            for (bool usePrepare : {false, true}) {
+                FrameDecoder decoder;
+                vector<Frame> decoded = decodeInPieces(stream, usePrepare, decoder);
+                CHECK(decoder.error(), c.second << " was accepted");
+                checkSame(before, decoded, c.second);
+
+                FrameView view;
+                decoder.feed(stream.data(), stream.size());
+                CHECK(!decoder.next(view), c.second << ": decoded a frame after the error");
+            }
+        }
+
+        // Not an error until the whole header is there
+        FrameDecoder decoder;
+        FrameView view;
+        decoder.feed(c.first.data(), FRAME_HEADER_SIZE - 1);
+        CHECK(!decoder.next(view) && !decoder.error(), c.second << ": error before the header was complete");
+        decoder.feed(c.first.data() + FRAME_HEADER_SIZE - 1, 1);
+        CHECK(!decoder.next(view) && decoder.error(), c.second << " was accepted");
+    }
+
+    // Random headers never crash the decoder or yield out-of-range views
+    for (int round = 0; round < ROUNDS * 10; round++) {
+        string stream = randomBytes(FRAME_HEADER_SIZE + randomSize(64));
+        FrameDecoder decoder;
+        decoder.feed(stream.data(), stream.size());
+        FrameView view;
+        while (decoder.next(view)) {
+            CHECK(view.target.size() + view.body.size() <= stream.size(), "view past the received bytes");
+        }
+    }
+}
+
+// ==========================
+// Main
+// ==========================
+
+int main(int argc, char* argv[]) {
+    seed = argc > 1 ? (unsigned)strtoul(argv[1], nullptr, 10) : random_device{}();
+    rng.seed(seed);
+
+    testRoundTrips();
+    testLimits();
+    testMalformed();
+
+    cout << "frame_decoder_test: passed (seed " << seed << ")" << endl;
+    return 0;
+}
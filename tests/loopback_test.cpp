@@ -0,0 +1,491 @@
+// tests/loopback_test.cpp
+// End-to-end test over loopback: starts the server binary on a free port and
+// drives it with framed and legacy text clients and with two users undoing
+// and redoing at once, then starts it again with rate limits and a
+// connection cap and checks that they apply, and once per overflow policy
+// with a client that never reads.
+//
+//   loopback_test <path to server> [server options...]
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/wait.h>
+
+#include "platform.h"
+#include "chat_protocol.h"
+
+using namespace std;
+
+#define EXPECT_TIMEOUT_MS 5000    // how long a client waits for an expected line
+#define STARTUP_TIMEOUT_MS 5000   // how long the server may take to listen
+#define SLOW_OUTBOUND_LIMIT 16384 // --outbound-limit for the slow consumer runs
+#define SLOW_LINE_SIZE 4096       // bytes per line sent past the slow consumer
+#define SLOW_MAX_LINES 4000       // give up if the policy has not fired by then
+
+pid_t serverPid = -1;
+
+void stopServer() {
+    if (serverPid > 0) {
+        kill(serverPid, SIGTERM);
+        waitpid(serverPid, nullptr, 0);
+        serverPid = -1;
+    }
+}
+
+#define CHECK(cond, what) \
+    do { \
+        if (!(cond)) { \
+            cerr << "loopback_test: FAILED at line " << __LINE__ << ": " << what << endl; \
+            stopServer(); \
+            exit(1); \
+        } \
+    } while (0)
+
+// ==========================
+// Server Process
+// ==========================
+
+int freePort() {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    bind(sock, (sockaddr*)&addr, sizeof(addr));
+    getsockname(sock, (sockaddr*)&addr, &len);
+    closesocket(sock);
+    return ntohs(addr.sin_port);
+}
+
+void startServer(const string& path, int port, const vector<string>& options) {
+    vector<string> args = {path, "--port=" + to_string(port)};
+    args.insert(args.end(), options.begin(), options.end());
+
+    serverPid = fork();
+    CHECK(serverPid >= 0, "fork failed");
+    if (serverPid == 0) {
+        // The server logs every connection to stdout; errors still show
+        freopen("/dev/null", "w", stdout);
+        vector<char*> argv;
+        for (auto& arg : args) argv.push_back(&arg[0]);
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+}
+
+// Value of one counter from the server's --metrics-port, -1 if it is missing
+long long metricValue(int metricsPort, const string& name) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)metricsPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    string response;
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) == 0) {
+        string request = "GET /metrics HTTP/1.0\r\n\r\n";
+        send(sock, request.data(), request.size(), 0);
+        char buf[4096];
+        ssize_t n;
+        while ((n = recv(sock, buf, sizeof(buf), 0)) > 0) response.append(buf, (size_t)n);
+    }
+    closesocket(sock);
+
+    size_t at = response.find("\n" + name + " ");
+    return at == string::npos ? -1 : atoll(response.c_str() + at + name.size() + 2);
+}
+
+// ==========================
+// Test Client
+// ==========================
+
+struct Frame {
+    FrameType type;
+    string target;
+    string body;
+};
+
+class TestClient {
+private:
+    SOCKET sock = INVALID_SOCKET;
+    bool framed;
+    FrameDecoder decoder;
+    vector<Frame> frames;   // framed: everything received, in order
+    size_t nextFrame = 0;   // first frame not matched by expect() yet
+    string text;            // text protocol: everything received
+    size_t textPos = 0;
+
+    // Waits up to timeoutMs for more bytes. False on timeout or disconnect.
+    bool receive(int timeoutMs) {
+        pollfd pfd{sock, POLLIN, 0};
+        if (poll(&pfd, 1, timeoutMs) <= 0) return false;
+
+        char buf[4096];
+        ssize_t n = recv(sock, buf, sizeof(buf), 0);
+        if (n <= 0) return false;
+        if (!framed) {
+            text.append(buf, (size_t)n);
+            return true;
+        }
+        decoder.feed(buf, (size_t)n);
+        FrameView view;
+        while (decoder.next(view)) {
+            frames.push_back({view.type, string(view.target), string(view.body)});
+        }
+        return !decoder.error();
+    }
+
+public:
+    explicit TestClient(bool framedProtocol) : framed(framedProtocol) {}
+
+    ~TestClient() {
+        if (sock != INVALID_SOCKET) closesocket(sock);
+    }
+
+    // receiveBuffer > 0 shrinks SO_RCVBUF, so a client that stops reading
+    // backs up into the server sooner
+    bool connectTo(int port, int receiveBuffer = 0) {
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (receiveBuffer > 0) {
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&receiveBuffer, sizeof(receiveBuffer));
+        }
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(sock, (sockaddr*)&addr, sizeof(addr)) == 0) return true;
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+        return false;
+    }
+
+    void sendFrame(FrameType type, const string& target, const string& body) {
+        string frame = encodeFrame(type, target, body);
+        CHECK(send(sock, frame.data(), frame.size(), 0) == (ssize_t)frame.size(), "send failed");
+    }
+
+    void sendText(const string& line) {
+        CHECK(send(sock, line.data(), line.size(), 0) == (ssize_t)line.size(), "send failed");
+    }
+
+    void disconnect() {
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+    }
+
+    // True once the server closes the connection, false on timeout
+    bool waitClosed() {
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(EXPECT_TIMEOUT_MS);
+        while (true) {
+            auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+            pollfd pfd{sock, POLLIN, 0};
+            if (left <= 0 || poll(&pfd, 1, (int)left) <= 0) return false;
+            char buf[4096];
+            if (recv(sock, buf, sizeof(buf), 0) <= 0) return true;
+        }
+    }
+
+    // Framed: the next frame of this type whose body contains needle
+    Frame expect(FrameType type, const string& needle) {
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(EXPECT_TIMEOUT_MS);
+        while (true) {
+            for (; nextFrame < frames.size(); nextFrame++) {
+                const Frame& frame = frames[nextFrame];
+                if (frame.type == type && frame.body.find(needle) != string::npos) {
+                    return frames[nextFrame++];
+                }
+            }
+            auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+            CHECK(left > 0 && receive((int)left), "no frame containing '" << needle << "'");
+        }
+    }
+
+    // Text protocol: waits until needle shows up after the last match
+    void expectText(const string& needle) {
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(EXPECT_TIMEOUT_MS);
+        while (true) {
+            size_t at = text.find(needle, textPos);
+            if (at != string::npos) {
+                textPos = at + needle.size();
+                return;
+            }
+            auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+            CHECK(left > 0 && receive((int)left), "no text containing '" << needle << "'");
+        }
+    }
+};
+
+// ==========================
+// Scenarios
+// ==========================
+
+void connectWhenUp(TestClient& client, int port) {
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(STARTUP_TIMEOUT_MS);
+    while (!client.connectTo(port)) {
+        CHECK(chrono::steady_clock::now() < deadline, "server did not start on port " << port);
+        this_thread::sleep_for(chrono::milliseconds(20));
+    }
+}
+
+// Chat lines, commands and room changes with both wire protocols
+void runChatScenario(int port) {
+    TestClient alice(true), bob(true), carol(false);
+    connectWhenUp(alice, port);
+
+    // Framed clients meet in the default room
+    alice.sendFrame(FrameType::Hello, "", "alice");
+    alice.expect(FrameType::ServerText, "Connected as 'alice'");
+    CHECK(bob.connectTo(port), "bob could not connect");
+    bob.sendFrame(FrameType::Hello, "", "bob");
+    bob.expect(FrameType::ServerText, "Connected as 'bob'");
+    alice.expect(FrameType::ServerText, "bob joined the room");
+
+    // A chat line reaches the room with its id; the sender gets a timestamp
+    alice.sendFrame(FrameType::Text, "", "hello loopback");
+    Frame line = bob.expect(FrameType::ChatLine, "[alice]: hello loopback");
+    CHECK(!line.target.empty(), "chat line without a message id");
+    alice.expect(FrameType::ServerText, "] \n");
+
+    // Private messages go to one user only
+    bob.sendFrame(FrameType::PrivateMessage, "alice", "psst");
+    alice.expect(FrameType::ServerText, "[PM from bob]: psst");
+    bob.expect(FrameType::ServerText, "[PM to alice]: psst");
+    bob.sendFrame(FrameType::Text, "", "/pm");
+    bob.expect(FrameType::ServerText, "Usage: /pm <user> <message>");
+    bob.sendFrame(FrameType::Text, "", "/reply");
+    bob.expect(FrameType::ServerText, "Usage: /reply <user> <message>");
+
+    // History and search see the line
+    alice.sendFrame(FrameType::Text, "", "/history");
+    alice.expect(FrameType::ServerText, "#" + line.target + " ");
+    alice.sendFrame(FrameType::Text, "", "/search loopback");
+    alice.expect(FrameType::ServerText, "Found 1 message(s)");
+    alice.sendFrame(FrameType::Text, "", "/search oopba");     // part of a word still matches
+    alice.expect(FrameType::ServerText, "Found 1 message(s)");
+
+    // Undo retracts the line everywhere
+    alice.sendFrame(FrameType::Text, "", "/undo");
+    alice.expect(FrameType::ServerText, "Last message undone.");
+    Frame retract = bob.expect(FrameType::Retract, line.target);
+    CHECK(retract.target == "chatroom", "retraction for room '" << retract.target << "'");
+
+    // Rejoining with the last id seen replays only the lines after it
+    alice.sendFrame(FrameType::Text, "", "sync one");
+    Frame seen = bob.expect(FrameType::ChatLine, "[alice]: sync one");
+    alice.sendFrame(FrameType::Text, "", "sync two");
+    Frame missed = bob.expect(FrameType::ChatLine, "[alice]: sync two");
+    bob.sendFrame(FrameType::Join, "chatroom", seen.target);
+    bob.expect(FrameType::ServerText, "You joined room: chatroom");
+    Frame replayed = bob.expect(FrameType::ChatLine, "]: sync ");
+    CHECK(replayed.target == missed.target, "replayed #" << replayed.target << " instead of #" << missed.target);
+
+    // A legacy text client in another room
+    CHECK(carol.connectTo(port), "carol could not connect");
+    carol.sendText("carol");
+    carol.expectText("Connected as 'carol'");
+    bob.expect(FrameType::ServerText, "carol joined the room");
+    carol.sendText("/join other");
+    carol.expectText("You joined room: other");
+    bob.sendFrame(FrameType::Join, "other", "");
+    bob.expect(FrameType::ServerText, "You joined room: other");
+    carol.expectText("bob joined the room");
+    carol.sendText("hi from text");
+    bob.expect(FrameType::ChatLine, "[carol]: hi from text");
+
+    // Leaving is announced to the room that is left
+    bob.sendFrame(FrameType::Join, "chatroom", "");
+    alice.expect(FrameType::ServerText, "bob joined the room");
+    alice.disconnect();
+    bob.expect(FrameType::ServerText, "alice left the room");
+
+    // A Join frame's target is the whole room name and its body must be an id
+    bob.sendFrame(FrameType::Join, "a since 3", "");
+    bob.expect(FrameType::ServerText, "You joined room: a since 3\n");
+    bob.sendFrame(FrameType::Join, "chatroom", "abc");
+    CHECK(bob.waitClosed(), "Join frame with a non-numeric id was accepted");
+}
+
+// Two users fire /undo and /redo at the same time. Each user's own steps
+// are ordered, so every retraction must name that user's lines in the
+// order their steps imply, whatever the other user does in between.
+void runUndoScenario(int port) {
+    TestClient gina(true), hank(true), ivan(true);
+    for (auto user : {make_pair(&ivan, "ivan"), make_pair(&gina, "gina"), make_pair(&hank, "hank")}) {
+        CHECK(user.first->connectTo(port), user.second << " could not connect");
+        user.first->sendFrame(FrameType::Hello, "", user.second);
+        user.first->sendFrame(FrameType::Join, "undo", "");
+        user.first->expect(FrameType::ServerText, "You joined room: undo");
+    }
+
+    // ivan watches and learns the id of every line
+    map<string, string> owner;      // message id -> user
+    map<string, vector<string>> ids;
+    for (int i = 1; i <= 3; i++) {
+        for (auto user : {make_pair(&gina, "gina"), make_pair(&hank, "hank")}) {
+            string text = string(user.second) + " line " + to_string(i);
+            user.first->sendFrame(FrameType::Text, "", text);
+            Frame line = ivan.expect(FrameType::ChatLine, "]: " + text);
+            owner[line.target] = user.second;
+            ids[user.second].push_back(line.target);
+        }
+    }
+
+    // undo 3, undo 2, redo 2, undo 2, undo 1, redo 1, redo 2, sent by both
+    // users back to back without waiting for replies
+    const char* steps[] = {"/undo", "/undo", "/redo", "/undo", "/undo", "/redo", "/redo"};
+    for (const char* step : steps) {
+        gina.sendFrame(FrameType::Text, "", step);
+        hank.sendFrame(FrameType::Text, "", step);
+    }
+
+    map<string, vector<string>> retracted;
+    for (int i = 0; i < 8; i++) {
+        Frame retract = ivan.expect(FrameType::Retract, "");
+        CHECK(retract.target == "undo", "retraction for room '" << retract.target << "'");
+        CHECK(owner.count(retract.body), "retraction of unknown message #" << retract.body);
+        retracted[owner[retract.body]].push_back(retract.body);
+    }
+    for (const char* user : {"gina", "hank"}) {
+        const vector<string>& own = ids[user];
+        vector<string> want = {own[2], own[1], own[1], own[0]};
+        CHECK(retracted[user] == want, user << "'s undos retracted the wrong lines");
+    }
+
+    // Lines 1 and 2 are back, line 3 stays undone. Each user's third redo
+    // is acknowledged before /history is asked for.
+    for (TestClient* user : {&gina, &hank}) {
+        for (int i = 0; i < 3; i++) user->expect(FrameType::ServerText, "Message redone.");
+    }
+    ivan.sendFrame(FrameType::Text, "", "/history");
+    string history = ivan.expect(FrameType::ServerText, "]: gina line 1").body;
+    for (const char* user : {"gina", "hank"}) {
+        for (int i = 1; i <= 3; i++) {
+            bool shown = history.find("]: " + string(user) + " line " + to_string(i) + "\n") != string::npos;
+            CHECK(shown == (i < 3), user << " line " << i << (shown ? " was not undone" : " was not redone"));
+        }
+    }
+}
+
+// Needs --user-rate=1 --user-burst=3 --room-rate=1 --room-burst=5
+// --max-connections=2. Everything runs well inside a second, so the
+// buckets do not refill in between.
+void runLimitsScenario(int port) {
+    TestClient dave(true), erin(true), frank(true);
+    connectWhenUp(dave, port);
+    dave.sendFrame(FrameType::Hello, "", "dave");
+    dave.expect(FrameType::ServerText, "Connected as 'dave'");
+    CHECK(erin.connectTo(port), "erin could not connect");
+    erin.sendFrame(FrameType::Hello, "", "erin");
+    erin.expect(FrameType::ServerText, "Connected as 'erin'");
+
+    // A third client is over the cap and is turned away at once
+    CHECK(frank.connectTo(port), "frank could not connect");
+    CHECK(frank.waitClosed(), "connection over --max-connections was not refused");
+
+    // dave's burst takes three lines and leaves the room two
+    for (int i = 1; i <= 4; i++) dave.sendFrame(FrameType::Text, "", "d" + to_string(i));
+    dave.expect(FrameType::ServerText, "Rate limit: you are sending too fast");
+    erin.expect(FrameType::ChatLine, "[dave]: d3");
+
+    // /reply posts to the room too and takes from the same bucket
+    erin.sendFrame(FrameType::Text, "", "e1");
+    erin.sendFrame(FrameType::Text, "", "/reply dave r1");
+    erin.sendFrame(FrameType::Text, "", "/reply dave r2");
+    erin.expect(FrameType::ServerText, "Rate limit: room 'chatroom' is busy");
+    dave.expect(FrameType::ChatLine, "[erin]: -> dave: r1");
+}
+
+// Needs --outbound-limit=SLOW_OUTBOUND_LIMIT --overflow=<policy> and
+// --metrics-port. slow stops reading after its welcome; alice keeps posting
+// large lines until the policy has fired, and bob must get every one of
+// them in step the whole time.
+void runSlowConsumerScenario(int port, int metricsPort, const string& policy, const string& counter) {
+    TestClient alice(true), bob(true), slow(true);
+    connectWhenUp(alice, port);
+    alice.sendFrame(FrameType::Hello, "", "alice");
+    alice.expect(FrameType::ServerText, "Connected as 'alice'");
+    CHECK(bob.connectTo(port), "bob could not connect");
+    bob.sendFrame(FrameType::Hello, "", "bob");
+    bob.expect(FrameType::ServerText, "Connected as 'bob'");
+    CHECK(slow.connectTo(port, 4096), "slow could not connect");
+    slow.sendFrame(FrameType::Hello, "", "slow");
+    slow.expect(FrameType::ServerText, "Connected as 'slow'");
+    bob.expect(FrameType::ServerText, "slow joined the room");
+
+    string padding(SLOW_LINE_SIZE, 'x');
+    auto sendLine = [&](int i) {
+        string tag = "fill " + to_string(i) + " ";
+        alice.sendFrame(FrameType::Text, "", tag + padding);
+        bob.expect(FrameType::ChatLine, "]: " + tag);
+    };
+
+    int sent = 0;
+    while (metricValue(metricsPort, counter) <= 0) {
+        CHECK(sent < SLOW_MAX_LINES, policy << ": " << counter << " did not move after " << sent << " lines");
+        for (int i = 0; i < 50; i++) sendLine(sent++);
+    }
+    // The room carries on after the policy has fired
+    for (int i = 0; i < 50; i++) sendLine(sent++);
+    CHECK(metricValue(metricsPort, "chat_broadcast_latency_seconds_count") > 0,
+          policy << ": broadcasts are missing from chat_broadcast_latency_seconds");
+
+    if (policy == "disconnect") {
+        CHECK(slow.waitClosed(), "slow client was not disconnected");
+    } else if (policy == "coalesce") {
+        slow.expect(FrameType::ServerText, "message(s) skipped, connection too slow");
+    } else {
+        // The oldest lines were dropped, never the newest
+        slow.expect(FrameType::ChatLine, "]: fill " + to_string(sent - 1) + " ");
+    }
+}
+
+// ==========================
+// Main
+// ==========================
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        cerr << "Usage: loopback_test <server> [server options...]" << endl;
+        return 2;
+    }
+    socketsInit();
+    vector<string> options(argv + 2, argv + argc);
+
+    int port = freePort();
+    startServer(argv[1], port, options);
+    runChatScenario(port);
+    runUndoScenario(port);
+    stopServer();
+
+    vector<string> limits = options;
+    limits.insert(limits.end(), {"--user-rate=1", "--user-burst=3", "--room-rate=1", "--room-burst=5",
+                                 "--max-connections=2"});
+    port = freePort();
+    startServer(argv[1], port, limits);
+    runLimitsScenario(port);
+    stopServer();
+
+    vector<pair<string, string>> policies = {{"drop-oldest", "chat_outbound_dropped_oldest_total"},
+                                             {"disconnect", "chat_outbound_disconnected_total"},
+                                             {"coalesce", "chat_outbound_coalesced_total"}};
+    for (const auto& policy : policies) {
+        vector<string> slow = options;
+        int metricsPort = freePort();
+        slow.insert(slow.end(), {"--outbound-limit=" + to_string(SLOW_OUTBOUND_LIMIT), "--overflow=" + policy.first,
+                                 "--metrics-port=" + to_string(metricsPort)});
+        port = freePort();
+        startServer(argv[1], port, slow);
+        runSlowConsumerScenario(port, metricsPort, policy.first, policy.second);
+        stopServer();
+    }
+
+    cout << "loopback_test: passed" << endl;
+    return 0;
+}